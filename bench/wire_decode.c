@@ -0,0 +1,94 @@
+#include "../wire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Decode throughput of READDIR responses in binary-le-1 and binary-le-2.
+// Usage: wire-decode [entries] [iterations]
+
+static uint64_t _Now() {
+	struct timespec tNow;
+	clock_gettime(CLOCK_MONOTONIC, &tNow);
+	return (uint64_t)tNow.tv_sec * 1000000000 + tNow.tv_nsec;
+}
+
+static uint64_t _Decode(uint8_t iVersion, const void* pData, size_t iSize, uint64_t iCount) {
+	struct fswire_decoder tDecoder;
+	struct fswire_entry tEntry;
+	uint64_t iChecksum = 0;
+	if(fswire_readdir_begin(&tDecoder, iVersion, pData, iSize)) return 0;
+	while(fswire_readdir_next(&tDecoder, &tEntry) > 0) iChecksum += tEntry.iNameSize + tEntry.tStat.iSize;
+	if(tDecoder.iRemaining) {
+		fprintf(stderr, "binary-le-%u: decoding failed with %lu of %lu entries remaining\n", iVersion, tDecoder.iRemaining, iCount);
+		exit(1);
+	}
+
+	return iChecksum;
+}
+
+static void _Run(const char* sLabel, uint8_t iVersion, uint32_t xFields, const struct fswire_entry* aEntries, uint64_t iCount, uint64_t iIterations) {
+	size_t iCapacity = iCount * (sizeof(struct fsrpc_dirent) + FSWIRE_MAX_NAME + 8) + 64;
+	void* pBuffer = malloc(iCapacity);
+	if(!pBuffer) exit(1);
+
+	size_t iSize = fswire_encode_readdir(iVersion, xFields, aEntries, iCount, pBuffer, iCapacity);
+	if(!iSize) {
+		fprintf(stderr, "%s: encoding failed\n", sLabel);
+		exit(1);
+	}
+
+	volatile uint64_t iChecksum = 0;
+	uint64_t iStart = _Now();
+	for(uint64_t i = 0; i < iIterations; ++i) iChecksum += _Decode(iVersion, pBuffer, iSize, iCount);
+	uint64_t iElapsed = _Now() - iStart;
+
+	double dEntries = (double)iCount * iIterations;
+	printf("%-24s %8.1f bytes/entry %8.2f ns/entry %10.1f MiB/s %8.2f Mentries/s\n",
+		sLabel,
+		(double)iSize / iCount,
+		iElapsed / dEntries,
+		(double)iSize * iIterations / (iElapsed / 1e9) / (1024 * 1024),
+		dEntries / (iElapsed / 1e3)
+	);
+
+	free(pBuffer);
+}
+
+int main(int argc, char* argv[]) {
+	uint64_t iCount = argc > 1 ? strtoull(argv[1], NULL, 0) : 10000;
+	uint64_t iIterations = argc > 2 ? strtoull(argv[2], NULL, 0) : 1000;
+	if(!iCount || !iIterations) return 1;
+
+	struct fswire_entry* aEntries = calloc(iCount, sizeof(struct fswire_entry));
+	char* aNames = malloc(iCount * 32);
+	if(!aEntries || !aNames) return 1;
+
+	srand(1);
+	for(uint64_t i = 0; i < iCount; ++i) {
+		char* sName = aNames + i * 32;
+		struct fswire_entry* pEntry = &aEntries[i];
+		pEntry->iNameSize = snprintf(sName, 32, "module_%06lu%s", i, i % 3 ? ".c" : ".h");
+		pEntry->sName = sName;
+		pEntry->tStat.iType = i % 10 ? 1 : 0;
+		pEntry->tStat.iSize = rand() % (256 * 1024);
+		pEntry->tStat.tModificationTime.iSeconds = 1700000000 + rand() % 86400;
+		pEntry->tStat.tModificationTime.iNanoseconds = rand() % 1000000000;
+		pEntry->tStat.tAccessTime = pEntry->tStat.tModificationTime;
+		pEntry->tStat.tMetadataChangeTime = pEntry->tStat.tModificationTime;
+		pEntry->tStat.tCreateTime = pEntry->tStat.tModificationTime;
+		pEntry->tStat.iMappedUser = 1000;
+		pEntry->tStat.iMappedGroup = 1000;
+		pEntry->tStat.xPermissionBits = 0644;
+	}
+
+	printf("%lu entries, %lu iterations\n", iCount, iIterations);
+	_Run("binary-le-1", 1, FSWIRE_ALL, aEntries, iCount, iIterations);
+	_Run("binary-le-2 all fields", 2, FSWIRE_ALL, aEntries, iCount, iIterations);
+	_Run("binary-le-2 stat fields", 2, FSWIRE_TYPE | FSWIRE_SIZE | FSWIRE_MTIME, aEntries, iCount, iIterations);
+	_Run("binary-le-2 names only", 2, 0, aEntries, iCount, iIterations);
+
+	free(aNames);
+	free(aEntries);
+	return 0;
+}
@@ -0,0 +1,337 @@
+#include "cache.h"
+#include "stats.h"
+#include "shared.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define INITIAL_BUCKETS 4096
+#define MAX_ENTRIES (256 * 1024)
+#define GENERATION_STRIPES 4096
+
+// Attributes and small file contents are kept per path. An entry's contents
+// are only served while its attributes are fresh and still describe the same
+// version of the file (size and modification time), so invalidating or
+// re-fetching the attributes implicitly invalidates the data as well.
+struct cache_entry {
+	struct cache_entry* pNext;
+	struct cache_entry* pNewer;
+	struct cache_entry* pOlder;
+	uint64_t iHash;
+
+	struct stat tStat;
+	time_t iExpires;
+	uint64_t iShared;
+	bool bHasStat;
+
+	void* pData;
+	uint64_t iDataSize;
+	struct timespec tDataVersion;
+
+	char sPath[];
+};
+
+static pthread_mutex_t g_tLock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry** g_aBuckets = NULL;
+static uint64_t g_iBucketCount = 0;
+static uint64_t g_iEntryCount = 0;
+static struct cache_entry* g_pNewest = NULL;
+static struct cache_entry* g_pOldest = NULL;
+static uint32_t g_iTTL = 0;
+static uint64_t g_iMaxDataSize = 0;
+static uint64_t g_iDataSize = 0;
+
+// Every invalidation bumps the generation of the path's stripe. A caller that
+// fetches attributes reads the generation before its request and the result
+// is only stored if no mutation of the path happened in the meantime, so a
+// reply that raced a write or unlink can't resurrect the old attributes.
+// With a shared cache the generation also counts the invalidations of the other
+// mounts, and entries remember the shared part they were stored under, so a
+// change made through another mount ends them as well.
+static uint64_t g_aGenerations[GENERATION_STRIPES];
+
+static uint64_t _Hash(const char* sPath) {
+	uint64_t iHash = 0xcbf29ce484222325;
+	while(*sPath) {
+		iHash ^= (uint8_t)*sPath++;
+		iHash *= 0x100000001b3;
+	}
+
+	return iHash;
+}
+
+static uint64_t* _Generation(const char* sPath) {
+	return &g_aGenerations[_Hash(sPath) % GENERATION_STRIPES];
+}
+
+static time_t _Now() {
+	struct timespec tNow;
+	clock_gettime(CLOCK_MONOTONIC, &tNow);
+	return tNow.tv_sec;
+}
+
+static void _Unlink(struct cache_entry* pEntry) {
+	if(pEntry->pNewer) pEntry->pNewer->pOlder = pEntry->pOlder;
+	else g_pNewest = pEntry->pOlder;
+	if(pEntry->pOlder) pEntry->pOlder->pNewer = pEntry->pNewer;
+	else g_pOldest = pEntry->pNewer;
+	pEntry->pNewer = pEntry->pOlder = NULL;
+}
+
+static void _PushNewest(struct cache_entry* pEntry) {
+	pEntry->pOlder = g_pNewest;
+	if(g_pNewest) g_pNewest->pNewer = pEntry;
+	g_pNewest = pEntry;
+	if(!g_pOldest) g_pOldest = pEntry;
+}
+
+static void _Touch(struct cache_entry* pEntry) {
+	if(g_pNewest == pEntry) return;
+	_Unlink(pEntry);
+	_PushNewest(pEntry);
+}
+
+static void _DropData(struct cache_entry* pEntry) {
+	if(!pEntry->pData) return;
+	free(pEntry->pData);
+	pEntry->pData = NULL;
+	g_iDataSize -= pEntry->iDataSize;
+	FSSTATS_SUB(iCacheBytes, pEntry->iDataSize);
+	pEntry->iDataSize = 0;
+}
+
+static void _Remove(struct cache_entry* pEntry) {
+	struct cache_entry** ppSlot = &g_aBuckets[pEntry->iHash & (g_iBucketCount - 1)];
+	while(*ppSlot != pEntry) ppSlot = &(*ppSlot)->pNext;
+	*ppSlot = pEntry->pNext;
+
+	_Unlink(pEntry);
+	_DropData(pEntry);
+	free(pEntry);
+	--g_iEntryCount;
+	FSSTATS_SUB(iCacheEntries, 1);
+}
+
+static void _Grow() {
+	uint64_t iNewCount = g_iBucketCount * 2;
+	struct cache_entry** aNewBuckets = calloc(iNewCount, sizeof(struct cache_entry*));
+	if(!aNewBuckets) return;
+
+	for(uint64_t i = 0; i < g_iBucketCount; ++i) {
+		struct cache_entry* pEntry = g_aBuckets[i];
+		while(pEntry) {
+			struct cache_entry* pNext = pEntry->pNext;
+			struct cache_entry** ppSlot = &aNewBuckets[pEntry->iHash & (iNewCount - 1)];
+			pEntry->pNext = *ppSlot;
+			*ppSlot = pEntry;
+			pEntry = pNext;
+		}
+	}
+
+	free(g_aBuckets);
+	g_aBuckets = aNewBuckets;
+	g_iBucketCount = iNewCount;
+}
+
+static struct cache_entry* _Find(const char* sPath, uint64_t iHash) {
+	struct cache_entry* pEntry = g_aBuckets[iHash & (g_iBucketCount - 1)];
+	while(pEntry) {
+		if(pEntry->iHash == iHash && strcmp(pEntry->sPath, sPath) == 0) return pEntry;
+		pEntry = pEntry->pNext;
+	}
+
+	return NULL;
+}
+
+static struct cache_entry* _FindOrCreate(const char* sPath) {
+	uint64_t iHash = _Hash(sPath);
+	struct cache_entry* pEntry = _Find(sPath, iHash);
+	if(pEntry) {
+		_Touch(pEntry);
+		return pEntry;
+	}
+
+	while(g_iEntryCount >= MAX_ENTRIES && g_pOldest) _Remove(g_pOldest);
+	if(g_iEntryCount >= g_iBucketCount) _Grow();
+
+	size_t iPathSize = strlen(sPath) + 1;
+	pEntry = calloc(1, sizeof(struct cache_entry) + iPathSize);
+	if(!pEntry) return NULL;
+
+	memcpy(pEntry->sPath, sPath, iPathSize);
+	pEntry->iHash = iHash;
+
+	struct cache_entry** ppSlot = &g_aBuckets[iHash & (g_iBucketCount - 1)];
+	pEntry->pNext = *ppSlot;
+	*ppSlot = pEntry;
+	_PushNewest(pEntry);
+
+	++g_iEntryCount;
+	FSSTATS_ADD(iCacheEntries, 1);
+	return pEntry;
+}
+
+static bool _IsFresh(struct cache_entry* pEntry) {
+	return pEntry->bHasStat && pEntry->iExpires > _Now() && pEntry->iShared == fsshared_generation(pEntry->sPath);
+}
+
+static bool _DataIsValid(struct cache_entry* pEntry) {
+	return pEntry->pData
+		&& _IsFresh(pEntry)
+		&& pEntry->iDataSize == (uint64_t)pEntry->tStat.st_size
+		&& pEntry->tDataVersion.tv_sec == pEntry->tStat.st_mtim.tv_sec
+		&& pEntry->tDataVersion.tv_nsec == pEntry->tStat.st_mtim.tv_nsec;
+}
+
+// ===================================================
+
+int8_t fscache_init(uint32_t iTTL, uint64_t iMaxDataSize) {
+	if(!(g_aBuckets = calloc(INITIAL_BUCKETS, sizeof(struct cache_entry*)))) return -1;
+	g_iBucketCount = INITIAL_BUCKETS;
+	g_iTTL = iTTL;
+	g_iMaxDataSize = iMaxDataSize;
+	return 0;
+}
+
+bool fscache_enabled() {
+	return g_iTTL != 0;
+}
+
+void fscache_cleanup() {
+	pthread_mutex_lock(&g_tLock);
+	while(g_pOldest) _Remove(g_pOldest);
+	free(g_aBuckets);
+	g_aBuckets = NULL;
+	g_iBucketCount = 0;
+	pthread_mutex_unlock(&g_tLock);
+}
+
+static bool _PutStat(const char* sPath, const struct stat* pStat, uint32_t iTTL, const char* sGuard, uint64_t iGeneration, uint64_t* pShared) {
+	// Read before the guard is checked, an invalidation by another mount after
+	// the check leaves the entry with an outdated generation.
+	uint64_t iShared = fsshared_generation(sPath);
+	pthread_mutex_lock(&g_tLock);
+	if(fscache_generation(sGuard) != iGeneration) {
+		pthread_mutex_unlock(&g_tLock);
+		return false;
+	}
+
+	struct cache_entry* pEntry = g_aBuckets ? _FindOrCreate(sPath) : NULL;
+	if(pEntry) {
+		pEntry->tStat = *pStat;
+		pEntry->iExpires = _Now() + iTTL;
+		pEntry->iShared = iShared;
+		pEntry->bHasStat = true;
+		if(pEntry->pData && !_DataIsValid(pEntry)) _DropData(pEntry);
+	}
+
+	pthread_mutex_unlock(&g_tLock);
+	if(pShared) *pShared = iShared;
+	return true;
+}
+
+bool fscache_get_stat(const char* sPath, struct stat* pOutput) {
+	if(!g_iTTL) return false;
+
+	pthread_mutex_lock(&g_tLock);
+	struct cache_entry* pEntry = g_aBuckets ? _Find(sPath, _Hash(sPath)) : NULL;
+	bool bHit = pEntry && _IsFresh(pEntry);
+	if(bHit) {
+		*pOutput = pEntry->tStat;
+		_Touch(pEntry);
+	}
+
+	pthread_mutex_unlock(&g_tLock);
+
+	if(bHit) FSSTATS_ADD(iStatHits, 1);
+	else FSSTATS_ADD(iStatMisses, 1);
+
+	// Another mount may have fetched the attributes already. They are cached
+	// locally for the rest of their lifetime in the shared table.
+	uint32_t iRemaining;
+	uint64_t iGeneration = fscache_generation(sPath);
+	if(!bHit && fsshared_get_stat(sPath, pOutput, &iRemaining)) {
+		_PutStat(sPath, pOutput, iRemaining, sPath, iGeneration, NULL);
+		bHit = true;
+	}
+
+	return bHit;
+}
+
+uint64_t fscache_generation(const char* sPath) {
+	return __atomic_load_n(_Generation(sPath), __ATOMIC_ACQUIRE) + fsshared_generation(sPath);
+}
+
+void fscache_put_stat(const char* sPath, const struct stat* pStat, const char* sGuard, uint64_t iGeneration) {
+	if(!g_iTTL) return;
+	uint64_t iShared;
+	if(_PutStat(sPath, pStat, g_iTTL, sGuard, iGeneration, &iShared)) fsshared_put_stat(sPath, pStat, iShared);
+}
+
+int fscache_read(const char* sPath, void* pBuffer, size_t iSize, off_t iOffset) {
+	if(!g_iMaxDataSize) return FSCACHE_MISS;
+
+	int iResult = FSCACHE_MISS;
+	pthread_mutex_lock(&g_tLock);
+	struct cache_entry* pEntry = g_aBuckets ? _Find(sPath, _Hash(sPath)) : NULL;
+	if(pEntry && _DataIsValid(pEntry)) {
+		iResult = 0;
+		if((uint64_t)iOffset < pEntry->iDataSize) {
+			uint64_t iAvailable = pEntry->iDataSize - iOffset;
+			iResult = iAvailable < iSize ? iAvailable : iSize;
+			memcpy(pBuffer, pEntry->pData + iOffset, iResult);
+		}
+
+		_Touch(pEntry);
+	}
+
+	pthread_mutex_unlock(&g_tLock);
+
+	if(iResult == FSCACHE_MISS) FSSTATS_ADD(iDataMisses, 1);
+	else FSSTATS_ADD(iDataHits, 1);
+	return iResult;
+}
+
+void fscache_put_data(const char* sPath, const void* pData, uint64_t iSize) {
+	if(!g_iMaxDataSize || iSize > g_iMaxDataSize) return;
+
+	void* pCopy = malloc(iSize ? iSize : 1);
+	if(!pCopy) return;
+	memcpy(pCopy, pData, iSize);
+
+	pthread_mutex_lock(&g_tLock);
+	struct cache_entry* pEntry = g_aBuckets ? _Find(sPath, _Hash(sPath)) : NULL;
+	if(!pEntry || !_IsFresh(pEntry) || (uint64_t)pEntry->tStat.st_size != iSize) {
+		pthread_mutex_unlock(&g_tLock);
+		free(pCopy);
+		return;
+	}
+
+	_DropData(pEntry);
+	_Touch(pEntry);
+
+	struct cache_entry* pVictim = g_pOldest;
+	while(pVictim && g_iDataSize + iSize > g_iMaxDataSize) {
+		struct cache_entry* pNext = pVictim->pNewer;
+		if(pVictim != pEntry) _DropData(pVictim);
+		pVictim = pNext;
+	}
+
+	pEntry->pData = pCopy;
+	pEntry->iDataSize = iSize;
+	pEntry->tDataVersion = pEntry->tStat.st_mtim;
+	g_iDataSize += iSize;
+	FSSTATS_ADD(iCacheBytes, iSize);
+	pthread_mutex_unlock(&g_tLock);
+}
+
+void fscache_invalidate(const char* sPath) {
+	pthread_mutex_lock(&g_tLock);
+	__atomic_add_fetch(_Generation(sPath), 1, __ATOMIC_RELEASE);
+	struct cache_entry* pEntry = g_aBuckets ? _Find(sPath, _Hash(sPath)) : NULL;
+	if(pEntry) _Remove(pEntry);
+	pthread_mutex_unlock(&g_tLock);
+
+	fsshared_invalidate(sPath);
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FSCACHE_MISS (-1)
+
+int8_t fscache_init(uint32_t iTTL, uint64_t iMaxDataSize);
+void fscache_cleanup();
+bool fscache_enabled();
+bool fscache_get_stat(const char* sPath, struct stat* pOutput);
+uint64_t fscache_generation(const char* sPath);
+void fscache_put_stat(const char* sPath, const struct stat* pStat, const char* sGuard, uint64_t iGeneration);
+int fscache_read(const char* sPath, void* pBuffer, size_t iSize, off_t iOffset);
+void fscache_put_data(const char* sPath, const void* pData, uint64_t iSize);
+void fscache_invalidate(const char* sPath);
@@ -0,0 +1,138 @@
+#include "control.h"
+#include "stats.h"
+#include "warmup.h"
+#include "trace.h"
+#include "os.h"
+
+#define MAX_CONTROL_SIZE (64 * 1024)
+
+// Pseudo files under FSCONTROL_DIR. Readable files are rendered once when
+// opened, so a reader always sees a consistent snapshot; every write to a
+// writable file is handed to its command handler as a single argument.
+struct control_buffer {
+	size_t iSize;
+	char aData[];
+};
+
+static size_t _RenderStats(char* sBuffer, size_t iSize) {
+	return fsstats_format(sBuffer, iSize);
+}
+
+static int _CommandWarmup(const char* sArgument) {
+	return fswarmup_start(sArgument);
+}
+
+static int _CommandTrace(const char* sArgument) {
+	return fstrace_command(sArgument);
+}
+
+static const struct control_file {
+	const char* sName;
+	size_t (*lRender)(char* sBuffer, size_t iSize);
+	int (*lCommand)(const char* sArgument);
+} g_aControlFiles[] = {
+	{ "stats", _RenderStats, NULL },
+	{ "warmup", NULL, _CommandWarmup },
+	{ "trace", NULL, _CommandTrace },
+};
+
+static const struct control_file* _Find(const char* sPath) {
+	const char* sName = sPath + strlen(FSCONTROL_DIR);
+	if(*sName++ != '/') return NULL;
+
+	for(size_t i = 0; i < sizeof(g_aControlFiles) / sizeof(*g_aControlFiles); ++i) {
+		if(strcmp(sName, g_aControlFiles[i].sName) == 0) return &g_aControlFiles[i];
+	}
+
+	return NULL;
+}
+
+// ===================================================
+
+bool fscontrol_match(const char* sPath) {
+	size_t iLength = strlen(FSCONTROL_DIR);
+	return strncmp(sPath, FSCONTROL_DIR, iLength) == 0 && (sPath[iLength] == '\0' || sPath[iLength] == '/');
+}
+
+int fscontrol_getattr(const char* sPath, struct stat* pOutput) {
+	memset(pOutput, 0, sizeof(struct stat));
+	if(strcmp(sPath, FSCONTROL_DIR) == 0) {
+		pOutput->st_mode = S_IFDIR | 0755;
+		pOutput->st_nlink = 2;
+		return 0;
+	}
+
+	const struct control_file* pControl = _Find(sPath);
+	if(!pControl) return -ENOENT;
+
+	pOutput->st_mode = S_IFREG | (pControl->lRender ? 0444 : 0) | (pControl->lCommand ? 0200 : 0);
+	pOutput->st_nlink = 1;
+	return 0;
+}
+
+int fscontrol_readdir(const char* sPath, void* pOutput, fuse_fill_dir_t lFiller) {
+	if(strcmp(sPath, FSCONTROL_DIR) != 0) return -ENOTDIR;
+	for(size_t i = 0; i < sizeof(g_aControlFiles) / sizeof(*g_aControlFiles); ++i) {
+		lFiller(pOutput, g_aControlFiles[i].sName, NULL, 0, 0);
+	}
+
+	return 0;
+}
+
+int fscontrol_open(const char* sPath, struct fuse_file_info* pFile) {
+	if(strcmp(sPath, FSCONTROL_DIR) == 0) return -EISDIR;
+	const struct control_file* pControl = _Find(sPath);
+	if(!pControl) return -ENOENT;
+
+	int iAccess = pFile->flags & O_ACCMODE;
+	if(iAccess != O_WRONLY && !pControl->lRender) return -EACCES;
+	if(iAccess != O_RDONLY && !pControl->lCommand) return -EACCES;
+
+	pFile->direct_io = 1;
+	pFile->fh = 0;
+	if(!pControl->lRender || iAccess == O_WRONLY) return 0;
+
+	struct control_buffer* pBuffer = malloc(sizeof(struct control_buffer) + MAX_CONTROL_SIZE);
+	if(!pBuffer) return -ENOMEM;
+	pBuffer->iSize = pControl->lRender(pBuffer->aData, MAX_CONTROL_SIZE);
+	pFile->fh = (uint64_t)(uintptr_t)pBuffer;
+	return 0;
+}
+
+int fscontrol_read(const char* sPath, char* pBuffer, size_t iSize, off_t iOffset, struct fuse_file_info* pFile) {
+	struct control_buffer* pContent = (void*)(uintptr_t)pFile->fh;
+	if(!pContent) return -EBADF;
+	if((size_t)iOffset >= pContent->iSize) return 0;
+
+	size_t iAvailable = pContent->iSize - iOffset;
+	if(iAvailable < iSize) iSize = iAvailable;
+	memcpy(pBuffer, pContent->aData + iOffset, iSize);
+	return iSize;
+}
+
+int fscontrol_write(const char* sPath, const char* pBuffer, size_t iSize, off_t iOffset, struct fuse_file_info* pFile) {
+	const struct control_file* pControl = _Find(sPath);
+	if(!pControl || !pControl->lCommand) return -EACCES;
+	if(iSize >= PATH_MAX) return -ENAMETOOLONG;
+
+	char sArgument[PATH_MAX];
+	size_t iLength = iSize;
+	memcpy(sArgument, pBuffer, iLength);
+	while(iLength && (sArgument[iLength - 1] == '\n' || sArgument[iLength - 1] == '\r' || sArgument[iLength - 1] == ' ')) --iLength;
+	sArgument[iLength] = '\0';
+
+	int iStatus = pControl->lCommand(sArgument);
+	return iStatus < 0 ? iStatus : (int)iSize;
+}
+
+int fscontrol_truncate(const char* sPath, off_t iSize) {
+	const struct control_file* pControl = _Find(sPath);
+	if(!pControl) return -ENOENT;
+	return pControl->lCommand ? 0 : -EACCES;
+}
+
+int fscontrol_release(const char* sPath, struct fuse_file_info* pFile) {
+	free((void*)(uintptr_t)pFile->fh);
+	pFile->fh = 0;
+	return 0;
+}
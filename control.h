@@ -0,0 +1,14 @@
+#pragma once
+#include "driver.h"
+#include <stdbool.h>
+
+#define FSCONTROL_DIR "/.hexalinq-drive"
+
+bool fscontrol_match(const char* sPath);
+int fscontrol_getattr(const char* sPath, struct stat* pOutput);
+int fscontrol_readdir(const char* sPath, void* pOutput, fuse_fill_dir_t lFiller);
+int fscontrol_open(const char* sPath, struct fuse_file_info* pFile);
+int fscontrol_read(const char* sPath, char* pBuffer, size_t iSize, off_t iOffset, struct fuse_file_info* pFile);
+int fscontrol_write(const char* sPath, const char* pBuffer, size_t iSize, off_t iOffset, struct fuse_file_info* pFile);
+int fscontrol_truncate(const char* sPath, off_t iSize);
+int fscontrol_release(const char* sPath, struct fuse_file_info* pFile);
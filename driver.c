@@ -1,9 +1,96 @@
 #include "driver.h"
 #include "rpc.h"
+#include "cache.h"
+#include "stats.h"
+#include "trace.h"
+#include "control.h"
+#include "warmup.h"
+#include "sched.h"
+#include "store.h"
+#include "shared.h"
+#include "record.h"
 #include "os.h"
 
+#if defined(FUSE_CAP_PASSTHROUGH)
+#include <sys/ioctl.h>
+#include <linux/fuse.h>
+#if defined(FUSE_DEV_IOC_BACKING_OPEN)
+#define HAVE_PASSTHROUGH 1
+#endif
+#endif
+
 #define MAX_METADATA_SIZE (8 * 1024 * 1024)
 #define MAX_CHUNK_SIZE (256 * 1024)
+#define MAX_MERGED_READ (1024 * 1024)
+#define STAT_FIELDS (FSWIRE_TYPE | FSWIRE_SIZE | FSWIRE_MTIME)
+
+static uint8_t g_iReaddirFormat = 1;
+#ifdef HAVE_PASSTHROUGH
+static bool g_bPassthrough = false;
+#endif
+
+#define MAX_PENDING_RANGES 8
+#define MAX_OPEN_BLOCKS 4
+
+// Regular files opened read-only get a handle when there is a local store. If
+// the store holds a complete copy that matches the attributes fetched on open,
+// the file is served from it: with passthrough the kernel reads the copy
+// directly, otherwise fsdriver_read does. Without a copy the reads go to the
+// server and their results are written into a new one. It is stored once the
+// reads have covered the whole file, as long as the file did not change in
+// the meantime. Reads that arrive out of order are tracked as pending ranges
+// until the gap before them is filled. A handle that starts reading far into
+// the file or skips around doesn't store anything. The attributes are fetched
+// from the server on open only to check a stored copy. Without one they are
+// taken from the cache when the handle is first read from, so an open that
+// finds no copy costs no extra round trip. With a shared cache the
+// handle reads blocks of the store for the version it was opened on, and keeps
+// the last ones it read open, one slot per block number modulo
+// MAX_OPEN_BLOCKS.
+struct open_block {
+	int iFD;
+	uint64_t iBlock;
+};
+
+struct open_file {
+	int iFD;
+	int iBackingID;
+	struct stat tStat;
+	uint64_t iGeneration;
+	bool bHasStat;
+	bool bStatValid;
+
+	pthread_mutex_t tLock;
+	struct fsstore_writer* pWriter;
+	bool bFillDone;
+	uint64_t iFilled;
+	uint32_t iPending;
+	struct { uint64_t iStart; uint64_t iEnd; } aPending[MAX_PENDING_RANGES];
+	struct open_block aBlocks[MAX_OPEN_BLOCKS];
+};
+
+// Concurrent reads of the same file share one READ. A read that falls inside
+// a fetch already in flight waits for it, and one that overlaps or touches a
+// fetch still queued for a connection slot widens it. The leader fixes the
+// range once it gets a slot, so a started fetch is never extended. Only reads
+// within the same cache generation of the path are merged, so a read issued
+// after a write never receives data fetched before it.
+struct read_fetch {
+	struct read_fetch* pNext;
+	const char* sPath;
+	uint64_t iGeneration;
+	off_t iOffset;
+	size_t iSize;
+	bool bStarted;
+	bool bDone;
+	uint32_t iWaiters;
+	int iStatus;
+	char* pData;
+	pthread_cond_t tCondition;
+};
+
+static pthread_mutex_t g_tFetchLock = PTHREAD_MUTEX_INITIALIZER;
+static struct read_fetch* g_pFetches = NULL;
 
 static inline size_t _AlignUp(size_t iValue, size_t iAlignment) {
 	size_t iRemainder = iValue % iAlignment;
@@ -11,133 +98,396 @@ static inline size_t _AlignUp(size_t iValue, size_t iAlignment) {
 	return iValue;
 }
 
-// ===================================================
+static int fsrpc_call_perform(fsrpc_request_t pRequest, int8_t bFree) {
+	if(!pRequest) return -ENOMEM;
 
-static void* fsdriver_init(struct fuse_conn_info* pConnection, struct fuse_config* pConfig) {
-	pConfig->kernel_cache = 1;
-	return NULL;
-}
+	int iStatus = fsrpc_perform_request(pRequest);
+	if(iStatus) {
+		fsrpc_free_request(pRequest);
+		return iStatus;
+	}
 
-static void fsdriver_destroy(void* pData) {
-	fsrpc_disconnect();
-	fsrpc_cleanup();
+	if(pRequest->tResponse.iCursor < 1) {
+		fsrpc_free_request(pRequest);
+		return -ECONNRESET;
+	}
+
+	iStatus = fsrpc_errno(*(uint8_t*)pRequest->tResponse.pMemory);
+	if(bFree || iStatus) fsrpc_free_request(pRequest);
+	return iStatus;
 }
 
-static int fsdriver_getattr(const char* sPath, struct stat* pOutput, struct fuse_file_info* pFile) {
+#define fsrpc_call_nodata(sEndpoint, ...) fsrpc_call_perform(fsrpc_create_request((sEndpoint), (const char*[]){ __VA_ARGS__, NULL}, MAX_METADATA_SIZE, 0), 1);
+#define fsrpc_call_path(sEndpoint, sPath) fsrpc_call_nodata(sEndpoint, "Path", sPath, "Format", "binary-le-1")
+
+static void _ConvertStat(fsrpc_stat_t pMetadata, struct stat* pOutput) {
 	memset(pOutput, 0, sizeof(struct stat));
-	if(strcmp(sPath, "/") == 0) {
-		pOutput->st_mode = S_IFDIR | 0755;
-		pOutput->st_nlink = 2;
-		return 0;
-	}
+	if(pMetadata->iType == 0) pOutput->st_mode = S_IFDIR | 0755;
+	else if(pMetadata->iType == 1) pOutput->st_mode = S_IFREG | 0755;
+	else pOutput->st_mode = 0755;
 
+	pOutput->st_nlink = 2;
+	pOutput->st_size = pMetadata->iSize;
+	pOutput->st_blocks = _AlignUp(pMetadata->iSize, 512) / 512;
+	pOutput->st_mtim.tv_sec = pMetadata->tModificationTime.iSeconds;
+	pOutput->st_mtim.tv_nsec = pMetadata->tModificationTime.iNanoseconds;
+}
+
+static int8_t _JoinPath(char* sOutput, const char* sParent, const char* sName) {
+	int iLength = snprintf(sOutput, PATH_MAX, "%s%s%s", sParent, strcmp(sParent, "/") ? "/" : "", sName);
+	return iLength < 0 || iLength >= PATH_MAX ? -1 : 0;
+}
+
+static int _ReadRemote(const char* sPath, char* pBuffer, size_t iSize, off_t iOffset, uint8_t xFlags) {
 	fsrpc_request_t pRequest = fsrpc_create_request(
-		"GETATTR", (const char*[]){
+		"READ",
+		(const char*[]){
 			"Path", sPath,
+			"Offset", UINT64_STR(iOffset),
+			"Size", UINT64_STR(iSize),
 			"Format", "binary-le-1",
+			NULL
+		}, 8 + iSize, xFlags
+	);
+
+	int iStatus = fsrpc_call_perform(pRequest, 0);
+	if(iStatus) return iStatus;
+
+	FSTRACE_SCOPE("parse", sPath, iOffset, pRequest->tResponse.iCursor);
+	if(pRequest->tResponse.iCursor < 8) {
+		fsrpc_free_request(pRequest);
+		return -EIO;
+	}
+
+	iStatus = pRequest->tResponse.iCursor - 8;
+	if(iStatus) memcpy(pBuffer, pRequest->tResponse.pMemory + 8, iStatus);
+	FSSTATS_ADD(iBytesRead, iStatus);
+	fsrpc_free_request(pRequest);
+	return iStatus;
+}
+
+static int _CopySlice(struct read_fetch* pFetch, char* pBuffer, size_t iSize, off_t iOffset) {
+	if(pFetch->iStatus < 0) return pFetch->iStatus;
+
+	off_t iSkip = iOffset - pFetch->iOffset;
+	if(iSkip >= pFetch->iStatus) return 0;
+
+	size_t iAvailable = pFetch->iStatus - iSkip;
+	if(iSize > iAvailable) iSize = iAvailable;
+	memcpy(pBuffer, pFetch->pData + iSkip, iSize);
+	return iSize;
+}
+
+static void _FreeFetch(struct read_fetch* pFetch) {
+	pthread_cond_destroy(&pFetch->tCondition);
+	free(pFetch->pData);
+	free(pFetch);
+}
+
+static int _ReadMerged(const char* sPath, char* pBuffer, size_t iSize, off_t iOffset) {
+	off_t iEnd = iOffset + iSize;
+	uint64_t iGeneration = fscache_generation(sPath);
+
+	pthread_mutex_lock(&g_tFetchLock);
+	struct read_fetch* pFetch = g_pFetches;
+	for(; pFetch; pFetch = pFetch->pNext) {
+		if(pFetch->iGeneration != iGeneration || strcmp(pFetch->sPath, sPath)) continue;
+
+		off_t iFetchEnd = pFetch->iOffset + pFetch->iSize;
+		if(iOffset >= pFetch->iOffset && iEnd <= iFetchEnd) break;
+		if(pFetch->bStarted || iOffset > iFetchEnd || iEnd < pFetch->iOffset) continue;
+
+		off_t iMergedOffset = iOffset < pFetch->iOffset ? iOffset : pFetch->iOffset;
+		off_t iMergedEnd = iEnd > iFetchEnd ? iEnd : iFetchEnd;
+		if(iMergedEnd - iMergedOffset > MAX_MERGED_READ) continue;
+
+		pFetch->iOffset = iMergedOffset;
+		pFetch->iSize = iMergedEnd - iMergedOffset;
+		break;
+	}
+
+	if(pFetch) {
+		++pFetch->iWaiters;
+		FSTRACE_SCOPE("merge", sPath, iOffset, iSize);
+		while(!pFetch->bDone) pthread_cond_wait(&pFetch->tCondition, &g_tFetchLock);
+
+		int iStatus = _CopySlice(pFetch, pBuffer, iSize, iOffset);
+		if(!--pFetch->iWaiters) _FreeFetch(pFetch);
+		pthread_mutex_unlock(&g_tFetchLock);
+
+		FSSTATS_ADD(iMergedReads, 1);
+		return iStatus;
+	}
+
+	pFetch = calloc(1, sizeof(struct read_fetch));
+	if(!pFetch) {
+		pthread_mutex_unlock(&g_tFetchLock);
+		return _ReadRemote(sPath, pBuffer, iSize, iOffset, 0);
+	}
+
+	pFetch->sPath = sPath;
+	pFetch->iGeneration = iGeneration;
+	pFetch->iOffset = iOffset;
+	pFetch->iSize = iSize;
+	pthread_cond_init(&pFetch->tCondition, NULL);
+	pFetch->pNext = g_pFetches;
+	g_pFetches = pFetch;
+	pthread_mutex_unlock(&g_tFetchLock);
+
+	// Waiting for a slot is what gives other readers the chance to widen the
+	// fetch, so the range is only read back after the slot is granted. The
+	// lane is then charged for whatever the fetch grew by.
+	uint8_t iLane = fssched_thread_lane(FSSCHED_DATA);
+	fssched_acquire(iLane, iSize);
+
+	pthread_mutex_lock(&g_tFetchLock);
+	pFetch->bStarted = true;
+	off_t iFetchOffset = pFetch->iOffset;
+	size_t iFetchSize = pFetch->iSize;
+	pthread_mutex_unlock(&g_tFetchLock);
+	if(iFetchSize > iSize) fssched_charge(iLane, iFetchSize - iSize);
+
+	int iStatus = -ENOMEM;
+	pFetch->pData = malloc(iFetchSize);
+	if(pFetch->pData) iStatus = _ReadRemote(sPath, pFetch->pData, iFetchSize, iFetchOffset, FSRPC_NO_SCHED);
+	fssched_release(iLane);
+
+	pthread_mutex_lock(&g_tFetchLock);
+	struct read_fetch** ppFetch = &g_pFetches;
+	while(*ppFetch != pFetch) ppFetch = &(*ppFetch)->pNext;
+	*ppFetch = pFetch->pNext;
+
+	pFetch->iStatus = iStatus;
+	pFetch->bDone = true;
+	iStatus = _CopySlice(pFetch, pBuffer, iSize, iOffset);
+
+	if(pFetch->iWaiters) pthread_cond_broadcast(&pFetch->tCondition);
+	else _FreeFetch(pFetch);
+	pthread_mutex_unlock(&g_tFetchLock);
+	return iStatus;
+}
+
+int fsdriver_list(const char* sPath, uint32_t xFields, fsdriver_list_cb lCallback, void* pContext) {
+	if(g_iReaddirFormat == 1) xFields = FSWIRE_ALL;
+	// Every mutation below the directory bumps its generation as well, so it
+	// guards the attributes of all the entries.
+	uint64_t iGeneration = fscache_generation(sPath);
+	fsrpc_request_t pRequest = fsrpc_create_request(
+		"READDIR", (const char*[]){
+			"Path", sPath,
+			"Format", g_iReaddirFormat == 1 ? "binary-le-1" : "binary-le-2",
+			"Fields", UINT32_STR(xFields),
 			"Max-Size", UINT64_STR(MAX_METADATA_SIZE),
 			NULL
 		},
-		MAX_METADATA_SIZE, 0
+		MAX_METADATA_SIZE, FSRPC_COALESCE
 	);
 
 	if(!pRequest) return -ENOMEM;
+	pRequest->iGeneration = iGeneration;
 	int iStatus = fsrpc_perform_request(pRequest);
 	if(iStatus) {
 		fsrpc_free_request(pRequest);
 		return iStatus;
 	}
 
-	if(pRequest->tResponse.iCursor < 8) {
+	FSTRACE_SCOPE("parse", sPath, 0, pRequest->tResponse.iCursor);
+	struct fswire_decoder tDecoder;
+	if(fswire_readdir_begin(&tDecoder, g_iReaddirFormat, pRequest->tResponse.pMemory, pRequest->tResponse.iCursor)) {
 		fsrpc_free_request(pRequest);
 		return -ECONNRESET;
 	}
 
-	uint8_t iErrorCode = *(uint8_t*)pRequest->tResponse.pMemory;
-	if(iErrorCode) {
+	if(tDecoder.iError) {
 		fsrpc_free_request(pRequest);
-		return fsrpc_errno(iErrorCode);
+		return fsrpc_errno(tDecoder.iError);
 	}
 
-	if(pRequest->tResponse.iCursor < 8 + sizeof(struct fsrpc_stat)) {
+	bool bHasStat = (tDecoder.xFields & STAT_FIELDS) == STAT_FIELDS;
+	char sChildPath[PATH_MAX];
+	struct fswire_entry tEntry;
+	struct stat tStat;
+	while((iStatus = fswire_readdir_next(&tDecoder, &tEntry)) > 0) {
+		if(_JoinPath(sChildPath, sPath, tEntry.sName)) continue;
+		if(bHasStat) {
+			_ConvertStat(&tEntry.tStat, &tStat);
+			fscache_put_stat(sChildPath, &tStat, sPath, iGeneration);
+		}
+
+		iStatus = lCallback(pContext, tEntry.sName, sChildPath, bHasStat ? &tStat : NULL);
+		if(iStatus) {
+			fsrpc_free_request(pRequest);
+			return iStatus;
+		}
+	}
+
+	if(iStatus < 0) {
+		fprintf(stderr, "readdir: Malformed entry in the listing of %s\n", sPath);
 		fsrpc_free_request(pRequest);
-		return -ECONNRESET;
+		return iStatus == -EIO ? -EIO : -ECONNRESET;
 	}
 
-	fsrpc_stat_t pMetadata = pRequest->tResponse.pMemory + 8;
-	if(pMetadata->iType == 0) pOutput->st_mode = S_IFDIR | 0755;
-	else if(pMetadata->iType == 1) pOutput->st_mode = S_IFREG | 0755;
-	else pOutput->st_mode = 0755;
+	uint64_t iTotalEntries = tDecoder.iRemaining;
+	uint64_t iRemaining = tDecoder.pEnd - tDecoder.pCursor;
+	if(iTotalEntries) fprintf(stderr, "readdir: Truncated response: %lu %s remaining\n", iTotalEntries, iTotalEntries == 1 ? "entry" : "entries");
+	else if(iRemaining) fprintf(stderr, "readdir: %lu %s not parsed\n", iRemaining, iRemaining == 1 ? "byte was" : "bytes were");
+	fsrpc_free_request(pRequest);
+	return 0;
+}
 
-	pOutput->st_nlink = 2;
-	pOutput->st_size = pMetadata->iSize;
-	pOutput->st_blocks = _AlignUp(pMetadata->iSize, 512) / 512;
-	pOutput->st_mtim.tv_sec = pMetadata->tModificationTime.iSeconds;
-	pOutput->st_mtim.tv_nsec = pMetadata->tModificationTime.iNanoseconds;
+// The contents are only kept if the path was not changed while they were read,
+// and they are stored under the attributes of the listing that found the file.
+int fsdriver_prefetch(const char* sPath, const struct stat* pStat) {
+	uint64_t iSize = pStat->st_size;
+	FSTRACE_SCOPE("prefetch", sPath, 0, iSize);
+	char* pData = malloc(iSize ? iSize : 1);
+	if(!pData) return -ENOMEM;
+
+	uint64_t iGeneration = fscache_generation(sPath);
+	uint64_t iOffset = 0;
+	while(iOffset < iSize) {
+		uint64_t iChunkSize = MAX_CHUNK_SIZE < iSize - iOffset ? MAX_CHUNK_SIZE : iSize - iOffset;
+		int iStatus = _ReadRemote(sPath, pData + iOffset, iChunkSize, iOffset, 0);
+		if(iStatus <= 0) {
+			free(pData);
+			return iStatus ? iStatus : -EIO;
+		}
 
-	fsrpc_free_request(pRequest);
+		iOffset += iStatus;
+	}
+
+	if(fscache_generation(sPath) == iGeneration) {
+		fscache_put_data(sPath, pData, iSize);
+		if(fsstore_enabled()) fsstore_put(sPath, pStat, pData, iSize);
+	}
+
+	free(pData);
 	return 0;
 }
 
-static int fsdriver_readdir(const char* sPath, void* pOutput, fuse_fill_dir_t lFiller, off_t iOffset, struct fuse_file_info* pFile, enum fuse_readdir_flags xFlags) {
+void fsdriver_set_readdir_format(uint8_t iVersion) {
+	g_iReaddirFormat = iVersion;
+}
+
+// ===================================================
+
+static void* fsdriver_init(struct fuse_conn_info* pConnection, struct fuse_config* pConfig) {
+	pConfig->kernel_cache = 1;
+#ifdef HAVE_PASSTHROUGH
+	if(fsstore_enabled() && (pConnection->capable & FUSE_CAP_PASSTHROUGH)) {
+		pConnection->want |= FUSE_CAP_PASSTHROUGH;
+		g_bPassthrough = true;
+	}
+#endif
+	if(fsrpc_start()) fprintf(stderr, "Failed to start the connection thread\n");
+	if(fstrace_start()) fprintf(stderr, "Failed to start the trace dumper\n");
+	if(fsstore_start()) fprintf(stderr, "Failed to start the cache-dir evictor\n");
+	fswarmup_autostart();
+	return NULL;
+}
+
+static void fsdriver_destroy(void* pData) {
+	fsrpc_stop();
+	fswarmup_stop();
+	fsstore_stop();
+	fsrpc_disconnect();
+	fsrpc_cleanup();
+	fscache_cleanup();
+	fsshared_cleanup();
+	fstrace_stop();
+	fsrecord_stop();
+}
+
+// Asks the server for the attributes, whatever the cache holds, and caches
+// the answer.
+static int _FetchAttributes(const char* sPath, struct stat* pOutput) {
+	uint64_t iGeneration = fscache_generation(sPath);
 	fsrpc_request_t pRequest = fsrpc_create_request(
-		"READDIR", (const char*[]){
+		"GETATTR", (const char*[]){
 			"Path", sPath,
 			"Format", "binary-le-1",
 			"Max-Size", UINT64_STR(MAX_METADATA_SIZE),
 			NULL
 		},
-		MAX_METADATA_SIZE, 0
+		MAX_METADATA_SIZE, FSRPC_COALESCE
 	);
 
-	lFiller(pOutput, ".", NULL, 0, 0);
-	lFiller(pOutput, "..", NULL, 0, 0);
-
+	if(!pRequest) return -ENOMEM;
+	pRequest->iGeneration = iGeneration;
 	int iStatus = fsrpc_perform_request(pRequest);
 	if(iStatus) {
 		fsrpc_free_request(pRequest);
 		return iStatus;
 	}
 
+	FSTRACE_SCOPE("parse", sPath, 0, pRequest->tResponse.iCursor);
 	if(pRequest->tResponse.iCursor < 8) {
 		fsrpc_free_request(pRequest);
 		return -ECONNRESET;
 	}
 
-	uint64_t iTotalEntries = *(uint64_t*)pRequest->tResponse.pMemory;
-	void* pNext = pRequest->tResponse.pMemory + 8;
-	uint64_t iRemaining = pRequest->tResponse.iCursor - 8;
+	uint8_t iErrorCode = *(uint8_t*)pRequest->tResponse.pMemory;
+	if(iErrorCode) {
+		fsrpc_free_request(pRequest);
+		return fsrpc_errno(iErrorCode);
+	}
 
-	while(iTotalEntries) {
-		if(iRemaining < sizeof(struct fsrpc_dirent)) break;
-		fsrpc_dirent_t pEntry = pNext;
-		uint32_t iEntrySize = sizeof(struct fsrpc_dirent) + pEntry->iNameSize + 1;
-		uint8_t iRemainder = iEntrySize % 8;
-		if(iRemainder) iEntrySize += 8 - iRemainder;
+	if(pRequest->tResponse.iCursor < 8 + sizeof(struct fsrpc_stat)) {
+		fsrpc_free_request(pRequest);
+		return -ECONNRESET;
+	}
 
-		if(iRemaining < iEntrySize) break;
-		if(pEntry->sName[pEntry->iNameSize] != '\0') break;
+	_ConvertStat(pRequest->tResponse.pMemory + 8, pOutput);
+	fscache_put_stat(sPath, pOutput, sPath, iGeneration);
 
-		lFiller(pOutput, pEntry->sName, NULL, 0, 0);
+	fsrpc_free_request(pRequest);
+	return 0;
+}
 
-		--iTotalEntries;
-		pNext += iEntrySize;
-		iRemaining -= iEntrySize;
+static int fsdriver_getattr(const char* sPath, struct stat* pOutput, struct fuse_file_info* pFile) {
+	FSTRACE_SCOPE("getattr", sPath, 0, 0);
+	memset(pOutput, 0, sizeof(struct stat));
+	if(strcmp(sPath, "/") == 0) {
+		pOutput->st_mode = S_IFDIR | 0755;
+		pOutput->st_nlink = 2;
+		return 0;
 	}
 
-	if(iTotalEntries) fprintf(stderr, "readdir: Truncated response: %lu %s remaining\n", iTotalEntries, iTotalEntries == 1 ? "entry" : "entries");
-	else if(iRemaining) fprintf(stderr, "readdir: %lu %s not parsed\n", iRemaining, iRemaining == 1 ? "byte was" : "bytes were");
-	fsrpc_free_request(pRequest);
+	if(fscontrol_match(sPath)) return fscontrol_getattr(sPath, pOutput);
+	if(fscache_get_stat(sPath, pOutput)) return 0;
+	return _FetchAttributes(sPath, pOutput);
+}
+
+struct readdir_context {
+	void* pOutput;
+	fuse_fill_dir_t lFiller;
+	bool bPlus;
+};
+
+static int _FillEntry(void* pContext, const char* sName, const char* sPath, const struct stat* pStat) {
+	struct readdir_context* pReaddir = pContext;
+	pReaddir->lFiller(pReaddir->pOutput, sName, pStat, 0, pStat && pReaddir->bPlus ? FUSE_FILL_DIR_PLUS : 0);
 	return 0;
 }
 
+static int fsdriver_readdir(const char* sPath, void* pOutput, fuse_fill_dir_t lFiller, off_t iOffset, struct fuse_file_info* pFile, enum fuse_readdir_flags xFlags) {
+	FSTRACE_SCOPE("readdir", sPath, 0, 0);
+	lFiller(pOutput, ".", NULL, 0, 0);
+	lFiller(pOutput, "..", NULL, 0, 0);
+
+	if(fscontrol_match(sPath)) return fscontrol_readdir(sPath, pOutput, lFiller);
+	bool bPlus = xFlags & FUSE_READDIR_PLUS;
+	return fsdriver_list(sPath, bPlus ? STAT_FIELDS : 0, _FillEntry, &(struct readdir_context){ pOutput, lFiller, bPlus });
+}
+
 static int fsdriver_statfs(const char* sPath, struct statvfs* pResponse) {
+	FSTRACE_SCOPE("statfs", sPath, 0, 0);
 	memset(pResponse, 0, sizeof(struct statvfs));
 
 	fsrpc_request_t pRequest = fsrpc_create_request(
 		"STATVFS",
 		(const char*[]){ "Format", "binary-le-1", NULL },
-		MAX_METADATA_SIZE, 0
+		MAX_METADATA_SIZE, FSRPC_COALESCE
 	);
 
 	if(!pRequest) return -ENOMEM;
@@ -148,6 +498,7 @@ static int fsdriver_statfs(const char* sPath, struct statvfs* pResponse) {
 		return iStatus;
 	}
 
+	FSTRACE_SCOPE("parse", sPath, 0, pRequest->tResponse.iCursor);
 	if(pRequest->tResponse.iCursor < sizeof(struct fsrpc_statvfs)) {
 		fsrpc_free_request(pRequest);
 		return -ECONNRESET;
@@ -166,47 +517,61 @@ static int fsdriver_statfs(const char* sPath, struct statvfs* pResponse) {
 	return 0;
 }
 
-static int fsrpc_call_perform(fsrpc_request_t pRequest, int8_t bFree) {
-	if(!pRequest) return -ENOMEM;
-
-	int iStatus = fsrpc_perform_request(pRequest);
-	if(iStatus) {
-		fsrpc_free_request(pRequest);
-		return iStatus;
-	}
-
-	if(pRequest->tResponse.iCursor < 1) {
-		fsrpc_free_request(pRequest);
-		return -ECONNRESET;
+// Runs once a mutation has completed, so that a lookup which raced it finds a
+// newer generation and doesn't cache what it saw before.
+// The parent goes first: a listing that stores the path's attributes under the
+// parent's generation either sees the parent change or reads the path's
+// generation before it is bumped, in this mount and in the others. Stored
+// copies are removed when a file is created, truncated, opened for writing or
+// unlinked, not for every write, which the changed modification time already
+// keeps from matching them.
+static void _InvalidatePath(const char* sPath, bool bRemoveCopy) {
+	char sParent[PATH_MAX];
+	const char* pSlash = strrchr(sPath, '/');
+	if(pSlash && pSlash != sPath && (size_t)(pSlash - sPath) < sizeof(sParent)) {
+		memcpy(sParent, sPath, pSlash - sPath);
+		sParent[pSlash - sPath] = '\0';
+		fscache_invalidate(sParent);
 	}
 
-	iStatus = fsrpc_errno(*(uint8_t*)pRequest->tResponse.pMemory);
-	if(bFree || iStatus) fsrpc_free_request(pRequest);
-	return iStatus;
+	fscache_invalidate(sPath);
+	if(bRemoveCopy) fsstore_remove(sPath);
 }
 
-#define fsrpc_call_nodata(sEndpoint, ...) fsrpc_call_perform(fsrpc_create_request((sEndpoint), (const char*[]){ __VA_ARGS__, NULL}, MAX_METADATA_SIZE, 0), 1);
-#define fsrpc_call_path(sEndpoint, sPath) fsrpc_call_nodata(sEndpoint, "Path", sPath, "Format", "binary-le-1")
-
 static int fsdriver_unlink(const char* sPath) {
-	return fsrpc_call_path("UNLINK", sPath);
+	FSTRACE_SCOPE("unlink", sPath, 0, 0);
+	if(fscontrol_match(sPath)) return -EPERM;
+	int iStatus = fsrpc_call_path("UNLINK", sPath);
+	_InvalidatePath(sPath, true);
+	return iStatus;
 }
 
 static int fsdriver_rmdir(const char* sPath) {
-	return fsrpc_call_path("RMDIR", sPath);
+	FSTRACE_SCOPE("rmdir", sPath, 0, 0);
+	if(fscontrol_match(sPath)) return -EPERM;
+	int iStatus = fsrpc_call_path("RMDIR", sPath);
+	_InvalidatePath(sPath, false);
+	return iStatus;
 }
 
 static int fsdriver_mkdir(const char* sPath, mode_t xMode) {
-	return fsrpc_call_nodata(
+	FSTRACE_SCOPE("mkdir", sPath, 0, 0);
+	if(fscontrol_match(sPath)) return -EPERM;
+	int iStatus = fsrpc_call_nodata(
 		"MKDIR",
 		"Path", sPath,
 		"Mode", UINT32_STR(xMode),
 		"Format", "binary-le-1"
 	);
+
+	_InvalidatePath(sPath, false);
+	return iStatus;
 }
 
 static int fsdriver_create(const char* sPath, mode_t xMode, struct fuse_file_info* pFile) {
-	return fsrpc_call_nodata(
+	FSTRACE_SCOPE("create", sPath, 0, 0);
+	if(fscontrol_match(sPath)) return -EPERM;
+	int iStatus = fsrpc_call_nodata(
 		"OPEN",
 		"Path", sPath,
 		"Access", UINT32_STR(O_RDWR),
@@ -216,10 +581,141 @@ static int fsdriver_create(const char* sPath, mode_t xMode, struct fuse_file_inf
 		"Excl", "1",
 		"Format", "binary-le-1"
 	);
+
+	_InvalidatePath(sPath, true);
+	return iStatus;
+}
+
+#ifdef HAVE_PASSTHROUGH
+static int _DeviceFD() {
+	return fuse_session_fd(fuse_get_session(fuse_get_context()->fuse));
+}
+
+static int _OpenBacking(int iFD) {
+	struct fuse_backing_map tMap = { .fd = iFD };
+	int iBackingID = ioctl(_DeviceFD(), FUSE_DEV_IOC_BACKING_OPEN, &tMap);
+	if(iBackingID > 0) return iBackingID;
+
+	// Registering a backing file needs CAP_SYS_ADMIN, so a daemon without it
+	// stops trying after the first refusal.
+	if(errno == EPERM) g_bPassthrough = false;
+	return 0;
+}
+
+static void _CloseBacking(int iBackingID) {
+	uint32_t iID = iBackingID;
+	ioctl(_DeviceFD(), FUSE_DEV_IOC_BACKING_CLOSE, &iID);
+}
+#endif
+
+// A cached stat can be up to cache-ttl seconds old, so the copy is checked
+// against attributes fetched for this open before the kernel gets to read it.
+static void _OpenStored(const char* sPath, struct fuse_file_info* pFile) {
+	struct open_file* pOpen = calloc(1, sizeof(struct open_file));
+	if(!pOpen) return;
+
+	pOpen->iGeneration = fscache_generation(sPath);
+	pOpen->iFD = -1;
+	if(fsstore_has_copy(sPath)) {
+		if(_FetchAttributes(sPath, &pOpen->tStat) || !S_ISREG(pOpen->tStat.st_mode)) {
+			free(pOpen);
+			return;
+		}
+
+		pOpen->bHasStat = pOpen->bStatValid = true;
+		pOpen->iFD = fsstore_open(sPath, &pOpen->tStat);
+		pOpen->bFillDone = pOpen->iFD >= 0 || !pOpen->tStat.st_size;
+	}
+
+	for(uint32_t i = 0; i < MAX_OPEN_BLOCKS; ++i) pOpen->aBlocks[i].iFD = -1;
+	pthread_mutex_init(&pOpen->tLock, NULL);
+#ifdef HAVE_PASSTHROUGH
+	if(pOpen->iFD >= 0 && g_bPassthrough) pOpen->iBackingID = _OpenBacking(pOpen->iFD);
+	if(pOpen->iBackingID) pFile->backing_id = pOpen->iBackingID;
+#endif
+	pFile->fh = (uintptr_t)pOpen;
+}
+
+static bool _PinStat(const char* sPath, struct open_file* pOpen) {
+	pthread_mutex_lock(&pOpen->tLock);
+	if(!pOpen->bHasStat) {
+		pOpen->bHasStat = true;
+		pOpen->bStatValid = !fsdriver_getattr(sPath, &pOpen->tStat, NULL) && S_ISREG(pOpen->tStat.st_mode);
+		pOpen->bFillDone = !pOpen->bStatValid || !pOpen->tStat.st_size;
+	}
+
+	bool bValid = pOpen->bStatValid;
+	pthread_mutex_unlock(&pOpen->tLock);
+	return bValid;
+}
+
+// The copy is only stored if the file is still the version the handle was
+// opened on, both locally and on the server.
+static void _CommitFill(const char* sPath, struct open_file* pOpen, struct fsstore_writer* pWriter) {
+	struct stat tStat;
+	if(fscache_generation(sPath) != pOpen->iGeneration
+		|| _FetchAttributes(sPath, &tStat)
+		|| tStat.st_size != pOpen->tStat.st_size
+		|| tStat.st_mtim.tv_sec != pOpen->tStat.st_mtim.tv_sec
+		|| tStat.st_mtim.tv_nsec != pOpen->tStat.st_mtim.tv_nsec) {
+		fsstore_abort(pWriter);
+		return;
+	}
+
+	fsstore_commit(pWriter);
+}
+
+static void _StopFill(struct open_file* pOpen) {
+	if(pOpen->pWriter) fsstore_abort(pOpen->pWriter);
+	pOpen->pWriter = NULL;
+	pOpen->bFillDone = true;
+}
+
+static void _FillStore(const char* sPath, struct open_file* pOpen, const char* pData, off_t iOffset, int iSize) {
+	uint64_t iStart = iOffset, iEnd = iOffset + iSize;
+	if(iSize <= 0) return;
+
+	pthread_mutex_lock(&pOpen->tLock);
+	if(pOpen->bFillDone || iEnd <= pOpen->iFilled || (!pOpen->pWriter && iStart > MAX_MERGED_READ)) {
+		pthread_mutex_unlock(&pOpen->tLock);
+		return;
+	}
+
+	if(!pOpen->pWriter && !(pOpen->pWriter = fsstore_begin(sPath, &pOpen->tStat))) _StopFill(pOpen);
+	else if(fsstore_write(pOpen->pWriter, pData, iSize, iOffset)) _StopFill(pOpen);
+	else if(iStart <= pOpen->iFilled) pOpen->iFilled = iEnd;
+	else if(pOpen->iPending < MAX_PENDING_RANGES) {
+		pOpen->aPending[pOpen->iPending].iStart = iStart;
+		pOpen->aPending[pOpen->iPending].iEnd = iEnd;
+		++pOpen->iPending;
+	} else _StopFill(pOpen);
+
+	for(uint32_t i = 0; i < pOpen->iPending;) {
+		if(pOpen->aPending[i].iStart > pOpen->iFilled) {
+			++i;
+			continue;
+		}
+
+		if(pOpen->aPending[i].iEnd > pOpen->iFilled) pOpen->iFilled = pOpen->aPending[i].iEnd;
+		pOpen->aPending[i] = pOpen->aPending[--pOpen->iPending];
+		i = 0;
+	}
+
+	struct fsstore_writer* pComplete = NULL;
+	if(!pOpen->bFillDone && pOpen->iFilled >= (uint64_t)pOpen->tStat.st_size) {
+		pComplete = pOpen->pWriter;
+		pOpen->pWriter = NULL;
+		pOpen->bFillDone = true;
+	}
+
+	pthread_mutex_unlock(&pOpen->tLock);
+	if(pComplete) _CommitFill(sPath, pOpen, pComplete);
 }
 
 static int fsdriver_open(const char* sPath, struct fuse_file_info* pFile) {
-	return fsrpc_call_nodata(
+	FSTRACE_SCOPE("open", sPath, 0, 0);
+	if(fscontrol_match(sPath)) return fscontrol_open(sPath, pFile);
+	int iStatus = fsrpc_call_nodata(
 		"OPEN",
 		"Path", sPath,
 		"Access", UINT32_STR(pFile->flags & O_ACCMODE),
@@ -229,39 +725,128 @@ static int fsdriver_open(const char* sPath, struct fuse_file_info* pFile) {
 		"Excl", "0",
 		"Format", "binary-le-1"
 	);
+
+	if(pFile->flags & O_TRUNC) _InvalidatePath(sPath, true);
+	else if((pFile->flags & O_ACCMODE) != O_RDONLY) fsstore_remove(sPath);
+	if(!iStatus && fsstore_enabled() && (pFile->flags & O_ACCMODE) == O_RDONLY) _OpenStored(sPath, pFile);
+	return iStatus;
+}
+
+// With a shared cache, reads go through the block store so that every block
+// is fetched once for all mounts of the host. The first reader of a missing
+// block fetches it while holding its lock, the others find it in the store
+// once they get the lock. Only reads through a store handle take this path,
+// they use the attributes pinned for the handle. Other reads, like those of
+// files opened for writing, go to the server directly. A block is only stored
+// if the path was not changed since the attributes were fetched, so it can't
+// hold data of a later version.
+static int _FetchBlock(const char* sPath, const struct stat* pStat, uint64_t iGeneration, uint64_t iBlock, char* pBuffer, size_t iSize, off_t iOffset) {
+	int iLock = fsstore_lock(sPath, iBlock);
+	int iStatus = fsstore_read_block(sPath, pStat, iBlock, pBuffer, iSize, iOffset);
+	if(iStatus >= 0) {
+		fsstore_unlock(iLock);
+		FSSTATS_ADD(iSharedBlockHits, 1);
+		return iStatus;
+	}
+
+	off_t iStart = iBlock * FSSTORE_BLOCK_SIZE;
+	size_t iBlockSize = pStat->st_size - iStart < FSSTORE_BLOCK_SIZE ? pStat->st_size - iStart : FSSTORE_BLOCK_SIZE;
+	char* pBlock = malloc(iBlockSize);
+	if(!pBlock) {
+		fsstore_unlock(iLock);
+		return -ENOMEM;
+	}
+
+	iStatus = _ReadMerged(sPath, pBlock, iBlockSize, iStart);
+	if(iStatus == (int)iBlockSize && fscache_generation(sPath) == iGeneration) fsstore_put_block(sPath, pStat, iBlock, pBlock, iBlockSize);
+	fsstore_unlock(iLock);
+	FSSTATS_ADD(iSharedBlockFetches, 1);
+
+	if(iStatus >= 0) {
+		iStatus = iStatus > iOffset ? iStatus - iOffset : 0;
+		if((size_t)iStatus > iSize) iStatus = iSize;
+		memcpy(pBuffer, pBlock + iOffset, iStatus);
+	}
+
+	free(pBlock);
+	return iStatus;
+}
+
+static int _ReadOpenBlock(const char* sPath, struct open_file* pOpen, uint64_t iBlock, char* pBuffer, size_t iSize, off_t iOffset) {
+	pthread_mutex_lock(&pOpen->tLock);
+	struct open_block* pBlock = &pOpen->aBlocks[iBlock % MAX_OPEN_BLOCKS];
+	if(pBlock->iFD < 0 || pBlock->iBlock != iBlock) {
+		int iFD = fsstore_open_block(sPath, &pOpen->tStat, iBlock);
+		if(iFD < 0) {
+			pthread_mutex_unlock(&pOpen->tLock);
+			return iFD;
+		}
+
+		if(pBlock->iFD >= 0) close(pBlock->iFD);
+		pBlock->iFD = iFD;
+		pBlock->iBlock = iBlock;
+	}
+
+	ssize_t iRead = pread(pBlock->iFD, pBuffer, iSize, iOffset);
+	pthread_mutex_unlock(&pOpen->tLock);
+	return iRead < 0 ? -errno : iRead;
+}
+
+static int _ReadBlocks(const char* sPath, struct open_file* pOpen, char* pBuffer, size_t iSize, off_t iOffset) {
+	const struct stat tStat = pOpen->tStat;
+	if(iOffset >= tStat.st_size) return 0;
+	if((uint64_t)iOffset + iSize > (uint64_t)tStat.st_size) iSize = tStat.st_size - iOffset;
+
+	size_t iDone = 0;
+	while(iDone < iSize) {
+		off_t iPosition = iOffset + iDone;
+		uint64_t iBlock = iPosition / FSSTORE_BLOCK_SIZE;
+		off_t iInBlock = iPosition % FSSTORE_BLOCK_SIZE;
+		size_t iLength = FSSTORE_BLOCK_SIZE - iInBlock < iSize - iDone ? FSSTORE_BLOCK_SIZE - iInBlock : iSize - iDone;
+
+		int iStatus = _ReadOpenBlock(sPath, pOpen, iBlock, pBuffer + iDone, iLength, iInBlock);
+		if(iStatus >= 0) FSSTATS_ADD(iSharedBlockHits, 1);
+		else iStatus = _FetchBlock(sPath, &tStat, pOpen->iGeneration, iBlock, pBuffer + iDone, iLength, iInBlock);
+		if(iStatus < 0) return iDone ? (int)iDone : iStatus;
+
+		iDone += iStatus;
+		if((size_t)iStatus < iLength) break;
+	}
+
+	return iDone;
 }
 
 static int fsdriver_read(const char* sPath, char* pBuffer, size_t iSize, off_t iOffset, struct fuse_file_info* pFile) {
+	FSTRACE_SCOPE("read", sPath, iOffset, iSize);
 	//printf("READ %lu %lu\n", iOffset, iSize);
+	if(fscontrol_match(sPath)) return fscontrol_read(sPath, pBuffer, iSize, iOffset, pFile);
 
-	fsrpc_request_t pRequest = fsrpc_create_request(
-		"READ",
-		(const char*[]){
-			"Path", sPath,
-			"Offset", UINT64_STR(iOffset),
-			"Size", UINT64_STR(iSize),
-			"Format", "binary-le-1",
-			NULL
-		}, 8 + iSize, 0
-	);
-
-	int iStatus = fsrpc_call_perform(pRequest, 0);
-	if(iStatus) return iStatus;
+	struct open_file* pOpen = pFile ? (struct open_file*)(uintptr_t)pFile->fh : NULL;
+	if(pOpen && pOpen->iFD >= 0) {
+		ssize_t iRead = pread(pOpen->iFD, pBuffer, iSize, iOffset);
+		return iRead < 0 ? -errno : iRead;
+	}
 
-	if(pRequest->tResponse.iCursor < 8) {
-		fsrpc_free_request(pRequest);
-		return -EIO;
+	// A file read in blocks is not stored as a complete copy as well.
+	if(pOpen && !_PinStat(sPath, pOpen)) pOpen = NULL;
+	bool bBlocks = pOpen && fsshared_enabled();
+	int iStatus = fscache_read(sPath, pBuffer, iSize, iOffset);
+	if(iStatus == FSCACHE_MISS) {
+		if(bBlocks) iStatus = _ReadBlocks(sPath, pOpen, pBuffer, iSize, iOffset);
+		else iStatus = _ReadMerged(sPath, pBuffer, iSize, iOffset);
 	}
 
-	iStatus = pRequest->tResponse.iCursor - 8;
-	if(iStatus) memcpy(pBuffer, pRequest->tResponse.pMemory + 8, iStatus);
-	fsrpc_free_request(pRequest);
+	if(pOpen && !bBlocks) _FillStore(sPath, pOpen, pBuffer, iOffset, iStatus);
 	return iStatus;
 }
 
 static int fsdriver_write(const char* sPath, const char* pBuffer, size_t iSize, off_t iOffset, struct fuse_file_info* pFile) {
+	FSTRACE_SCOPE("write", sPath, iOffset, iSize);
+	if(fscontrol_match(sPath)) return fscontrol_write(sPath, pBuffer, iSize, iOffset, pFile);
+
+	int iStatus = 0;
 	size_t iRemaining = iSize;
-	while(iRemaining) {
+	while(iRemaining && !iStatus) {
 		size_t iChunkSize = MAX_CHUNK_SIZE < iRemaining ? MAX_CHUNK_SIZE : iRemaining;
 		//printf("WRITE %lu %lu\n", iOffset, iChunkSize);
 
@@ -271,30 +856,62 @@ static int fsdriver_write(const char* sPath, const char* pBuffer, size_t iSize,
 			MAX_METADATA_SIZE, 0
 		);
 
-		if(!pRequest) return -ENOMEM;
+		if(!pRequest) {
+			iStatus = -ENOMEM;
+			break;
+		}
+
 		if(fsrpc_upload_buffer(pRequest, pBuffer, iChunkSize)) {
 			fsrpc_free_request(pRequest);
-			return -EIO;
+			iStatus = -EIO;
+			break;
 		}
 
-		int iStatus = fsrpc_call_perform(pRequest, 1);
-		if(iStatus) return iStatus;
+		iStatus = fsrpc_call_perform(pRequest, 1);
+		if(iStatus) break;
 
+		FSSTATS_ADD(iBytesWritten, iChunkSize);
 		iOffset += iChunkSize;
 		iRemaining -= iChunkSize;
 	}
 
-	return iSize;
+	_InvalidatePath(sPath, false);
+	return iStatus ? iStatus : (int)iSize;
 }
 
-/*static int fsdriver_truncate(const char* sPath, off_t iSize, struct fuse_file_info* pFile) {
-	return fsrpc_call_nodata(
+static int fsdriver_truncate(const char* sPath, off_t iSize, struct fuse_file_info* pFile) {
+	FSTRACE_SCOPE("truncate", sPath, 0, iSize);
+	if(fscontrol_match(sPath)) return fscontrol_truncate(sPath, iSize);
+	return -ENOSYS;
+
+	/*return fsrpc_call_nodata(
 		"TRUNCATE",
 		"Path", sPath,
 		"Size", UINT64_STR(iSize),
 		"Format", "binary-le-1",
-	);
-}*/
+	);*/
+}
+
+static int fsdriver_release(const char* sPath, struct fuse_file_info* pFile) {
+	FSTRACE_SCOPE("release", sPath, 0, 0);
+	if(fscontrol_match(sPath)) return fscontrol_release(sPath, pFile);
+	if(!pFile->fh) return 0;
+
+	struct open_file* pOpen = (struct open_file*)(uintptr_t)pFile->fh;
+#ifdef HAVE_PASSTHROUGH
+	if(pOpen->iBackingID) _CloseBacking(pOpen->iBackingID);
+#endif
+	if(pOpen->iFD >= 0) close(pOpen->iFD);
+	for(uint32_t i = 0; i < MAX_OPEN_BLOCKS; ++i) {
+		if(pOpen->aBlocks[i].iFD >= 0) close(pOpen->aBlocks[i].iFD);
+	}
+
+	if(pOpen->pWriter) fsstore_abort(pOpen->pWriter);
+	pthread_mutex_destroy(&pOpen->tLock);
+	free(pOpen);
+	pFile->fh = 0;
+	return 0;
+}
 
 const struct fuse_operations fsdriver_operations = {
 	.init           = fsdriver_init,
@@ -309,5 +926,68 @@ const struct fuse_operations fsdriver_operations = {
 	.create		= fsdriver_create,
 	.read		= fsdriver_read,
 	.write		= fsdriver_write,
-	//.truncate	= fsdriver_truncate,
+	.truncate	= fsdriver_truncate,
+	.release	= fsdriver_release,
 };
+
+// ===================================================
+// Recording
+// ===================================================
+
+// With recording on, the operations table is copied at startup and every
+// operation that has a record type is swapped for a shim that times the
+// original and records it. Operations added to the driver later keep working
+// and are simply not recorded until they get a shim. Calls on the control
+// files are not part of the workload and pass through unrecorded.
+static struct fuse_operations g_tRecorded;
+
+#define RECORDED(iOp, sPath, iOffset, iSize, xMember, ...) { \
+	if(fscontrol_match(sPath)) return g_tRecorded.xMember(__VA_ARGS__); \
+	uint64_t iStart = fsrecord_begin(); \
+	int iResult = g_tRecorded.xMember(__VA_ARGS__); \
+	fsrecord_end(iOp, sPath, iOffset, iSize, iStart, iResult); \
+	return iResult; \
+}
+
+static int _RecordGetattr(const char* sPath, struct stat* pOutput, struct fuse_file_info* pFile)
+	RECORDED(FSRECORD_GETATTR, sPath, 0, 0, getattr, sPath, pOutput, pFile)
+static int _RecordReaddir(const char* sPath, void* pOutput, fuse_fill_dir_t lFiller, off_t iOffset, struct fuse_file_info* pFile, enum fuse_readdir_flags xFlags)
+	RECORDED(FSRECORD_READDIR, sPath, iOffset, 0, readdir, sPath, pOutput, lFiller, iOffset, pFile, xFlags)
+static int _RecordStatfs(const char* sPath, struct statvfs* pResponse)
+	RECORDED(FSRECORD_STATFS, sPath, 0, 0, statfs, sPath, pResponse)
+static int _RecordUnlink(const char* sPath)
+	RECORDED(FSRECORD_UNLINK, sPath, 0, 0, unlink, sPath)
+static int _RecordRmdir(const char* sPath)
+	RECORDED(FSRECORD_RMDIR, sPath, 0, 0, rmdir, sPath)
+static int _RecordMkdir(const char* sPath, mode_t xMode)
+	RECORDED(FSRECORD_MKDIR, sPath, 0, xMode, mkdir, sPath, xMode)
+static int _RecordOpen(const char* sPath, struct fuse_file_info* pFile)
+	RECORDED(FSRECORD_OPEN, sPath, 0, pFile->flags, open, sPath, pFile)
+static int _RecordCreate(const char* sPath, mode_t xMode, struct fuse_file_info* pFile)
+	RECORDED(FSRECORD_CREATE, sPath, 0, xMode, create, sPath, xMode, pFile)
+static int _RecordRead(const char* sPath, char* pBuffer, size_t iSize, off_t iOffset, struct fuse_file_info* pFile)
+	RECORDED(FSRECORD_READ, sPath, iOffset, iSize, read, sPath, pBuffer, iSize, iOffset, pFile)
+static int _RecordWrite(const char* sPath, const char* pBuffer, size_t iSize, off_t iOffset, struct fuse_file_info* pFile)
+	RECORDED(FSRECORD_WRITE, sPath, iOffset, iSize, write, sPath, pBuffer, iSize, iOffset, pFile)
+static int _RecordTruncate(const char* sPath, off_t iSize, struct fuse_file_info* pFile)
+	RECORDED(FSRECORD_TRUNCATE, sPath, 0, iSize, truncate, sPath, iSize, pFile)
+static int _RecordRelease(const char* sPath, struct fuse_file_info* pFile)
+	RECORDED(FSRECORD_RELEASE, sPath, 0, 0, release, sPath, pFile)
+
+#define RECORD(xMember, lShim) if(pOperations->xMember) pOperations->xMember = lShim
+
+void fsdriver_record_operations(struct fuse_operations* pOperations) {
+	g_tRecorded = *pOperations;
+	RECORD(getattr, _RecordGetattr);
+	RECORD(readdir, _RecordReaddir);
+	RECORD(statfs, _RecordStatfs);
+	RECORD(unlink, _RecordUnlink);
+	RECORD(rmdir, _RecordRmdir);
+	RECORD(mkdir, _RecordMkdir);
+	RECORD(open, _RecordOpen);
+	RECORD(create, _RecordCreate);
+	RECORD(read, _RecordRead);
+	RECORD(write, _RecordWrite);
+	RECORD(truncate, _RecordTruncate);
+	RECORD(release, _RecordRelease);
+}
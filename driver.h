@@ -1,5 +1,12 @@
 #pragma once
 #define FUSE_USE_VERSION 31
 #include <fuse.h>
+#include <stdint.h>
+
+typedef int (*fsdriver_list_cb)(void* pContext, const char* sName, const char* sPath, const struct stat* pStat);
 
 extern const struct fuse_operations fsdriver_operations;
+void fsdriver_record_operations(struct fuse_operations* pOperations);
+void fsdriver_set_readdir_format(uint8_t iVersion);
+int fsdriver_list(const char* sPath, uint32_t xFields, fsdriver_list_cb lCallback, void* pContext);
+int fsdriver_prefetch(const char* sPath, const struct stat* pStat);
@@ -1,5 +1,12 @@
 #include "rpc.h"
 #include "driver.h"
+#include "cache.h"
+#include "store.h"
+#include "shared.h"
+#include "record.h"
+#include "warmup.h"
+#include "trace.h"
+#include "sched.h"
 #include "os.h"
 
 /*
@@ -25,13 +32,51 @@ static struct Options {
 	const char* sTokenPath;
 	int bShowHelp;
 	int bDebug;
-} tOptions;
+	unsigned int iCacheTTL;
+	unsigned int iCacheSize;
+	unsigned int iCacheDirSize;
+	const char* sCacheDir;
+	const char* sSharedCache;
+	const char* sWarmupPath;
+	unsigned int iWarmupJobs;
+	unsigned int iWarmupPrefetch;
+	unsigned int iReaddirFormat;
+	int bAsyncInit;
+	unsigned int iConnections;
+	int bTrace;
+	const char* sTracePath;
+	unsigned int iMaxRequests;
+	const char* sRecordPath;
+} tOptions = {
+	.iCacheTTL = 0,
+	.iCacheSize = 64,
+	.iCacheDirSize = 4096,
+	.iWarmupJobs = 8,
+	.iReaddirFormat = 1,
+	.iConnections = 4,
+	.iMaxRequests = 16,
+};
 
 #define OPTION(t, p) { t, offsetof(struct Options, p), 1 }
 static const struct fuse_opt option_spec[] = {
 	OPTION("token=%s", sToken),
 	OPTION("token-file=%s", sTokenPath),
 	OPTION("debug", bDebug),
+	OPTION("cache-ttl=%u", iCacheTTL),
+	OPTION("cache-size=%u", iCacheSize),
+	OPTION("cache-dir-size=%u", iCacheDirSize),
+	OPTION("cache-dir=%s", sCacheDir),
+	OPTION("shared-cache=%s", sSharedCache),
+	OPTION("warmup=%s", sWarmupPath),
+	OPTION("warmup-jobs=%u", iWarmupJobs),
+	OPTION("warmup-prefetch=%u", iWarmupPrefetch),
+	OPTION("readdir-format=%u", iReaddirFormat),
+	OPTION("async-init", bAsyncInit),
+	OPTION("connections=%u", iConnections),
+	OPTION("trace", bTrace),
+	OPTION("trace-file=%s", sTracePath),
+	OPTION("max-requests=%u", iMaxRequests),
+	OPTION("record=%s", sRecordPath),
 	OPTION("-h", bShowHelp),
 	OPTION("--help", bShowHelp),
 	FUSE_OPT_END
@@ -43,10 +88,25 @@ static void show_help(const char* progname) {
 	printf("\n");
 	printf("Usage: %s [options] -o<token=ACCESS_TOKEN|token-file=PATH> <remote-path> <mountpoint>\n\n", progname);
 	printf("Filesystem specific options:\n"
-	       "    -o token=<s>         Hexalinq Drive access token\n"
-	       "    -o token-file=<s>    File to read the access token from\n"
-	       "    -o debug             Keep the process in foreground and turn on debugging output\n"
-	       "    --help               Display the help message\n"
+	       "    -o token=<s>             Hexalinq Drive access token\n"
+	       "    -o token-file=<s>        File to read the access token from\n"
+	       "    -o debug                 Keep the process in foreground and turn on debugging output\n"
+	       "    -o cache-ttl=<n>         Seconds to cache file attributes for, 0 disables caching (default: 0)\n"
+	       "    -o cache-size=<n>        MiB of memory to cache small file contents in (default: 64)\n"
+	       "    -o cache-dir=<s>         Directory to keep complete copies of prefetched and fully read files in\n"
+	       "    -o cache-dir-size=<n>    MiB the cache-dir may use, least recently used files are removed beyond that (default: 4096)\n"
+	       "    -o shared-cache=<s>      Share file blocks, and attributes when cache-ttl is set, with the other mounts using this name (needs cache-dir)\n"
+	       "    -o warmup=<s>            Crawl the given directory after mounting to fill the caches (needs cache-ttl)\n"
+	       "    -o warmup-jobs=<n>       Number of concurrent READDIR requests during warm-up (default: 8)\n"
+	       "    -o warmup-prefetch=<n>   Also prefetch the contents of files up to <n> KiB during warm-up (needs cache-ttl)\n"
+	       "    -o readdir-format=<n>    Directory listing wire format, binary-le-<n> (1 or 2, default: 1)\n"
+	       "    -o async-init            Mount immediately and connect to the server in the background\n"
+	       "    -o connections=<n>       Number of connections to open in advance (default: 4)\n"
+	       "    -o max-requests=<n>      Maximum number of concurrent requests, at least 2, 0 disables scheduling (default: 16)\n"
+	       "    -o trace                 Record request traces from the start\n"
+	       "    -o trace-file=<s>        File to dump traces to on SIGUSR1 (default: hexalinq-drive-trace.<pid>.json in the cache-dir, $XDG_RUNTIME_DIR, /run or $HOME)\n"
+	       "    -o record=<s>            Record every file system call to the given file for tools/replay\n"
+	       "    --help                   Display the help message\n"
 	       "\n");
 }
 
@@ -144,8 +204,29 @@ static int _HandleArgs(struct fuse_args* args) {
 		fsrpc_set_debug(1);
 	}
 
+	if((tOptions.iReaddirFormat != 1 && tOptions.iReaddirFormat != 2) || (tOptions.sSharedCache && !tOptions.sCacheDir)) {
+		show_help(args->argv[0]);
+		return 1;
+	}
+
+	if((tOptions.sWarmupPath || tOptions.iWarmupPrefetch) && !tOptions.iCacheTTL) {
+		fprintf(stderr, "warmup and warmup-prefetch need a cache-ttl, without one nothing they fetch is kept\n");
+		return 1;
+	}
+
+	fsdriver_set_readdir_format(tOptions.iReaddirFormat);
+	if(fsrecord_start(tOptions.sRecordPath)) crash("fsrecord_start");
+	if(fscache_init(tOptions.iCacheTTL, (uint64_t)tOptions.iCacheSize * 1024 * 1024)) crash("fscache_init");
+	if(fsstore_configure(tOptions.sCacheDir, sToken, fsrpc_get_root(), (uint64_t)tOptions.iCacheDirSize * 1024 * 1024)) crash("fsstore_configure");
+	if(fstrace_configure(tOptions.bTrace, tOptions.sTracePath, tOptions.sCacheDir)) crash("fstrace_configure");
+	if(fsshared_configure(tOptions.sSharedCache, sToken, fsrpc_get_root(), tOptions.iCacheTTL)) crash("fsshared_configure");
+	if(fswarmup_configure(tOptions.iWarmupJobs, (uint64_t)tOptions.iWarmupPrefetch * 1024, tOptions.sWarmupPath)) crash("fswarmup_configure");
 	if(fsrpc_set_token(sToken)) crash("fsrpc_set_token");
-	if(fsrpc_connect()) crash("fsrpc_connect");
+	fsrpc_set_connections(tOptions.iConnections);
+	fsrpc_set_max_connections(tOptions.iMaxRequests > tOptions.iConnections ? tOptions.iMaxRequests : tOptions.iConnections);
+	if(tOptions.iMaxRequests) fssched_configure(tOptions.iMaxRequests);
+	fsrpc_set_async(tOptions.bAsyncInit);
+	if(!tOptions.bAsyncInit && fsrpc_connect()) crash("fsrpc_connect");
 
 	return 0;
 }
@@ -153,7 +234,9 @@ static int _HandleArgs(struct fuse_args* args) {
 int main(int argc, char *argv[]) {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	if(_HandleArgs(&args)) crash("Invalid arguments");
-	if(fuse_main(args.argc, args.argv, &fsdriver_operations, NULL)) crash("libfuse error");
+	struct fuse_operations tOperations = fsdriver_operations;
+	if(tOptions.sRecordPath) fsdriver_record_operations(&tOperations);
+	if(fuse_main(args.argc, args.argv, &tOperations, NULL)) crash("libfuse error");
 	fuse_opt_free_args(&args);
 	return 0;
 }
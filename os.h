@@ -7,3 +7,5 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <limits.h>
+#include <pthread.h>
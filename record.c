@@ -0,0 +1,227 @@
+#include "record.h"
+#include "os.h"
+#include <time.h>
+
+#define BUFFER_SIZE (256 * 1024)
+#define MAX_RECORD_SIZE (1 + 6 * 10 + PATH_MAX)
+#define FLUSH_INTERVAL_NS 1000000000
+
+// Records are encoded under one lock into a buffer that is written out when
+// it fills up, when a record ends more than FLUSH_INTERVAL_NS after the last
+// write, and when recording stops. A daemon that is killed therefore only
+// loses the calls of about the last second before its final call. The lock
+// also orders the prefix compression of the paths and the relative start
+// times.
+
+static bool g_bRecording = false;
+
+static pthread_mutex_t g_tLock = PTHREAD_MUTEX_INITIALIZER;
+static int g_iFD = -1;
+static uint8_t* g_pBuffer = NULL;
+static size_t g_iBufferSize = 0;
+static uint64_t g_iOrigin = 0;
+static uint64_t g_iFlushed = 0;
+static uint64_t g_iPreviousStart = 0;
+static size_t g_iPreviousPathSize = 0;
+static char g_sPreviousPath[PATH_MAX];
+
+static const char* g_aOpNames[FSRECORD_OP_COUNT] = {
+	[FSRECORD_GETATTR] = "getattr",
+	[FSRECORD_READDIR] = "readdir",
+	[FSRECORD_STATFS] = "statfs",
+	[FSRECORD_OPEN] = "open",
+	[FSRECORD_CREATE] = "create",
+	[FSRECORD_READ] = "read",
+	[FSRECORD_WRITE] = "write",
+	[FSRECORD_TRUNCATE] = "truncate",
+	[FSRECORD_RELEASE] = "release",
+	[FSRECORD_UNLINK] = "unlink",
+	[FSRECORD_MKDIR] = "mkdir",
+	[FSRECORD_RMDIR] = "rmdir",
+};
+
+const char* fsrecord_op_name(uint8_t iOp) {
+	return iOp < FSRECORD_OP_COUNT ? g_aOpNames[iOp] : "unknown";
+}
+
+static uint64_t _Now() {
+	struct timespec tNow;
+	clock_gettime(CLOCK_MONOTONIC, &tNow);
+	return (uint64_t)tNow.tv_sec * 1000000000 + tNow.tv_nsec;
+}
+
+// ===================================================
+// Writing
+// ===================================================
+
+static inline uint8_t* _WriteVarint(uint8_t* pCursor, uint64_t iValue) {
+	while(iValue >= 0x80) {
+		*pCursor++ = (iValue & 0x7f) | 0x80;
+		iValue >>= 7;
+	}
+
+	*pCursor++ = iValue;
+	return pCursor;
+}
+
+static inline uint64_t _Zigzag(int64_t iValue) {
+	return ((uint64_t)iValue << 1) ^ (uint64_t)(iValue >> 63);
+}
+
+static void _Flush() {
+	const uint8_t* pCursor = g_pBuffer;
+	while(g_iBufferSize) {
+		ssize_t iWritten = write(g_iFD, pCursor, g_iBufferSize);
+		if(iWritten < 0 && errno == EINTR) continue;
+		if(iWritten <= 0) {
+			perror("record");
+			__atomic_store_n(&g_bRecording, false, __ATOMIC_RELAXED);
+			break;
+		}
+
+		pCursor += iWritten;
+		g_iBufferSize -= iWritten;
+	}
+
+	g_iBufferSize = 0;
+}
+
+int8_t fsrecord_start(const char* sPath) {
+	if(!sPath) return 0;
+
+	g_pBuffer = malloc(BUFFER_SIZE);
+	if(!g_pBuffer) return -1;
+
+	g_iFD = open(sPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(g_iFD < 0) {
+		perror("open");
+		free(g_pBuffer);
+		g_pBuffer = NULL;
+		return -1;
+	}
+
+	memcpy(g_pBuffer, FSRECORD_MAGIC, FSRECORD_MAGIC_SIZE);
+	g_iBufferSize = FSRECORD_MAGIC_SIZE;
+	g_iOrigin = g_iFlushed = _Now();
+	__atomic_store_n(&g_bRecording, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void fsrecord_stop() {
+	if(g_iFD < 0) return;
+
+	pthread_mutex_lock(&g_tLock);
+	__atomic_store_n(&g_bRecording, false, __ATOMIC_RELAXED);
+	_Flush();
+	close(g_iFD);
+	g_iFD = -1;
+	free(g_pBuffer);
+	g_pBuffer = NULL;
+	pthread_mutex_unlock(&g_tLock);
+}
+
+uint64_t fsrecord_begin() {
+	if(__builtin_expect(!__atomic_load_n(&g_bRecording, __ATOMIC_RELAXED), 1)) return 0;
+	return _Now();
+}
+
+void fsrecord_end(uint8_t iOp, const char* sPath, uint64_t iOffset, uint64_t iSize, uint64_t iStart, int64_t iResult) {
+	if(!iStart) return;
+	uint64_t iEnd = _Now();
+
+	size_t iPathSize = strnlen(sPath, PATH_MAX - 1);
+	pthread_mutex_lock(&g_tLock);
+	if(!g_bRecording) {
+		pthread_mutex_unlock(&g_tLock);
+		return;
+	}
+
+	if(g_iBufferSize + MAX_RECORD_SIZE > BUFFER_SIZE) _Flush();
+
+	size_t iPrefix = 0;
+	while(iPrefix < g_iPreviousPathSize && iPrefix < iPathSize && g_sPreviousPath[iPrefix] == sPath[iPrefix]) ++iPrefix;
+
+	uint64_t iDuration = iEnd - iStart;
+	iStart -= g_iOrigin;
+	uint8_t* pCursor = g_pBuffer + g_iBufferSize;
+	*pCursor++ = iOp;
+	pCursor = _WriteVarint(pCursor, _Zigzag((int64_t)(iStart - g_iPreviousStart)));
+	pCursor = _WriteVarint(pCursor, iDuration);
+	pCursor = _WriteVarint(pCursor, _Zigzag(iResult));
+	pCursor = _WriteVarint(pCursor, iOffset);
+	pCursor = _WriteVarint(pCursor, iSize);
+	pCursor = _WriteVarint(pCursor, iPrefix);
+	pCursor = _WriteVarint(pCursor, iPathSize - iPrefix);
+	memcpy(pCursor, sPath + iPrefix, iPathSize - iPrefix);
+	pCursor += iPathSize - iPrefix;
+
+	g_iBufferSize = pCursor - g_pBuffer;
+	g_iPreviousStart = iStart;
+	memcpy(g_sPreviousPath + iPrefix, sPath + iPrefix, iPathSize - iPrefix);
+	g_iPreviousPathSize = iPathSize;
+	if(iEnd - g_iFlushed >= FLUSH_INTERVAL_NS) {
+		_Flush();
+		g_iFlushed = iEnd;
+	}
+
+	pthread_mutex_unlock(&g_tLock);
+}
+
+// ===================================================
+// Reading
+// ===================================================
+
+static inline bool _ReadVarint(struct fsrecord_reader* pReader, uint64_t* pValue) {
+	uint64_t iValue = 0;
+	for(uint8_t iShift = 0; iShift < 64 && pReader->pCursor < pReader->pEnd; iShift += 7) {
+		uint8_t iByte = *pReader->pCursor++;
+		iValue |= (uint64_t)(iByte & 0x7f) << iShift;
+		if(!(iByte & 0x80)) {
+			*pValue = iValue;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static inline int64_t _Unzigzag(uint64_t iValue) {
+	return (int64_t)((iValue >> 1) ^ -(iValue & 1));
+}
+
+int fsrecord_reader_begin(struct fsrecord_reader* pReader, const void* pData, size_t iSize) {
+	memset(pReader, 0, sizeof(struct fsrecord_reader));
+	if(iSize < FSRECORD_MAGIC_SIZE || memcmp(pData, FSRECORD_MAGIC, FSRECORD_MAGIC_SIZE)) return -EPROTO;
+
+	pReader->pCursor = (const uint8_t*)pData + FSRECORD_MAGIC_SIZE;
+	pReader->pEnd = (const uint8_t*)pData + iSize;
+	return 0;
+}
+
+int fsrecord_reader_next(struct fsrecord_reader* pReader, struct fsrecord_entry* pEntry) {
+	if(pReader->pCursor == pReader->pEnd) return 0;
+
+	pEntry->iOp = *pReader->pCursor++;
+	uint64_t iStart, iResult, iPrefix, iSuffix;
+	if(!_ReadVarint(pReader, &iStart) ||
+		!_ReadVarint(pReader, &pEntry->iDuration) ||
+		!_ReadVarint(pReader, &iResult) ||
+		!_ReadVarint(pReader, &pEntry->iOffset) ||
+		!_ReadVarint(pReader, &pEntry->iSize) ||
+		!_ReadVarint(pReader, &iPrefix) ||
+		!_ReadVarint(pReader, &iSuffix)) return -EPROTO;
+
+	if(pEntry->iOp >= FSRECORD_OP_COUNT || iPrefix > pReader->iPathSize || iSuffix >= PATH_MAX - iPrefix) return -EPROTO;
+	if(iSuffix > (uint64_t)(pReader->pEnd - pReader->pCursor)) return -EPROTO;
+
+	memcpy(pReader->sPath + iPrefix, pReader->pCursor, iSuffix);
+	pReader->pCursor += iSuffix;
+	pReader->iPathSize = iPrefix + iSuffix;
+	pReader->sPath[pReader->iPathSize] = '\0';
+
+	pReader->iStart += _Unzigzag(iStart);
+	pEntry->iStart = pReader->iStart;
+	pEntry->iResult = _Unzigzag(iResult);
+	pEntry->sPath = pReader->sPath;
+	return 1;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limits.h>
+
+/*
+    Workload recording
+
+    A recording is the magic FSRECORD_MAGIC followed by one record per served
+    file system call, in the order the calls completed. Integers are unsigned
+    LEB128 varints like in binary-le-2.
+
+        uint8_t op (FSRECORD_*)
+        varint  zigzag start time in ns, relative to the previous record
+        varint  duration in ns
+        varint  zigzag result, a negative errno or the call's return value
+        varint  offset
+        varint  size, the open flags for open and the mode for create and
+                mkdir
+        varint  length of the prefix shared with the previous path
+        varint  length of the suffix that follows
+        byte[]  suffix
+
+    Start times are relative to the first call, so a recording can be
+    replayed with the original timing.
+*/
+
+#define FSRECORD_MAGIC "HXDREC1\n"
+#define FSRECORD_MAGIC_SIZE 8
+
+enum fsrecord_op {
+	FSRECORD_GETATTR,
+	FSRECORD_READDIR,
+	FSRECORD_STATFS,
+	FSRECORD_OPEN,
+	FSRECORD_CREATE,
+	FSRECORD_READ,
+	FSRECORD_WRITE,
+	FSRECORD_TRUNCATE,
+	FSRECORD_RELEASE,
+	FSRECORD_UNLINK,
+	FSRECORD_MKDIR,
+	FSRECORD_RMDIR,
+	FSRECORD_OP_COUNT,
+};
+
+struct fsrecord_entry {
+	uint8_t iOp;
+	uint64_t iStart;
+	uint64_t iDuration;
+	int64_t iResult;
+	uint64_t iOffset;
+	uint64_t iSize;
+	const char* sPath;
+};
+
+struct fsrecord_reader {
+	const uint8_t* pCursor;
+	const uint8_t* pEnd;
+	uint64_t iStart;
+	size_t iPathSize;
+	char sPath[PATH_MAX];
+};
+
+const char* fsrecord_op_name(uint8_t iOp);
+int8_t fsrecord_start(const char* sPath);
+void fsrecord_stop();
+uint64_t fsrecord_begin();
+void fsrecord_end(uint8_t iOp, const char* sPath, uint64_t iOffset, uint64_t iSize, uint64_t iStart, int64_t iResult);
+int fsrecord_reader_begin(struct fsrecord_reader* pReader, const void* pData, size_t iSize);
+int fsrecord_reader_next(struct fsrecord_reader* pReader, struct fsrecord_entry* pEntry);
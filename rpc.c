@@ -1,13 +1,67 @@
 #include "rpc.h"
+#include "stats.h"
+#include "trace.h"
+#include "sched.h"
 #include <string.h>
 #include <stdlib.h>
 #include <curl/curl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#define READY_TIMEOUT 60
+#define MAX_RETRY_DELAY 30
+#define INIT_CONNECT_TIMEOUT 10
+#define METADATA_COST 4096
 
 static char* g_sTokenHeader = NULL;
 static char* g_sRootHeader = NULL;
 static char* g_sURL = NULL;
 static bool g_bDebug = false;
+static bool g_bAsync = false;
+static uint32_t g_iConnections = 0;
+static uint32_t g_iMaxConnections = 0;
+
+// Requests share DNS lookups, TLS sessions and, most importantly, the pool of
+// open connections, so only the first request to the endpoint pays for the
+// TCP and TLS handshakes.
+static CURLSH* g_hShare = NULL;
+static pthread_mutex_t g_aShareLocks[CURL_LOCK_DATA_LAST];
+
+// Every request other than INIT waits until INIT has succeeded. In the
+// default mode that happens before the file system is mounted; with async
+// startup INIT is retried in the background while early callers block here.
+static pthread_mutex_t g_tStateLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_tStateCondition = PTHREAD_COND_INITIALIZER;
+static int g_iReadyStatus = -EINPROGRESS;
+static bool g_bStopping = false;
+static pthread_t g_hBackground;
+static bool g_bBackground = false;
+
+// Identical read-only requests that are in flight at the same time are
+// performed once. The first caller becomes the leader and performs the
+// request, later callers with the same key wait for it and receive a copy of
+// its response. A flight is removed from the list as soon as the leader's
+// transfer ends, so a request issued after that always goes to the server.
+// Callers tag requests with the cache generation of their path, which a
+// mutation bumps once it completes, so a request made after a write or
+// unlink never joins a flight that started before it.
+struct flight {
+	struct flight* pNext;
+	const char* pKey;
+	size_t iKeySize;
+	uint64_t iGeneration;
+	uint32_t iFollowers;
+	bool bDone;
+	int iStatus;
+	long iStatusCode;
+	void* pResponse;
+	uintmax_t iResponseSize;
+	pthread_cond_t tCondition;
+};
+
+static pthread_mutex_t g_tFlightLock = PTHREAD_MUTEX_INITIALIZER;
+static struct flight* g_pFlights = NULL;
 
 // ===================================================
 // curl
@@ -49,6 +103,14 @@ static size_t curl_membuffer_readcb(void* pData, size_t iSize, size_t iBlocks, s
 	return iSize;
 }
 
+static void curl_share_lockcb(CURL* hHandle, curl_lock_data iData, curl_lock_access iAccess, void* pUser) {
+	pthread_mutex_lock(&g_aShareLocks[iData]);
+}
+
+static void curl_share_unlockcb(CURL* hHandle, curl_lock_data iData, void* pUser) {
+	pthread_mutex_unlock(&g_aShareLocks[iData]);
+}
+
 static int curl_progresscb(void* this, double dltotal, double dlnow, double ultotal, double ulnow) {
 	//printf("DOWNLOADED: %.2f KB  TOTAL SIZE: %.2f KB  UP: %.2f KB  UP-TOTAL: %.2f KB\n", dlnow / 1024, dltotal / 1024, ulnow / 1024, ultotal / 1024);
 	return 0;
@@ -70,6 +132,10 @@ int8_t fsrpc_set_root(const char* sRoot) {
 	return 0;
 }
 
+const char* fsrpc_get_root() {
+	return g_sRootHeader;
+}
+
 int8_t fsrpc_set_endpoint(const char* sEndpoint) {
 	if(!(g_sURL = strdup(sEndpoint))) return -1;
 	return 0;
@@ -79,8 +145,28 @@ void fsrpc_set_debug(bool bDebug) {
 	g_bDebug = bDebug;
 }
 
+void fsrpc_set_async(bool bAsync) {
+	g_bAsync = bAsync;
+}
+
+void fsrpc_set_connections(uint32_t iConnections) {
+	g_iConnections = iConnections;
+}
+
+void fsrpc_set_max_connections(uint32_t iMaxConnections) {
+	g_iMaxConnections = iMaxConnections;
+}
+
 int8_t fsrpc_init() {
 	if(curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) return -1;
+
+	for(int i = 0; i < CURL_LOCK_DATA_LAST; ++i) pthread_mutex_init(&g_aShareLocks[i], NULL);
+	if(!(g_hShare = curl_share_init())) return -1;
+	if(curl_share_setopt(g_hShare, CURLSHOPT_LOCKFUNC, curl_share_lockcb) != CURLSHE_OK) return -1;
+	if(curl_share_setopt(g_hShare, CURLSHOPT_UNLOCKFUNC, curl_share_unlockcb) != CURLSHE_OK) return -1;
+	if(curl_share_setopt(g_hShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK) return -1;
+	if(curl_share_setopt(g_hShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK) return -1;
+	if(curl_share_setopt(g_hShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK) return -1;
 	return 0;
 }
 
@@ -100,6 +186,11 @@ void fsrpc_cleanup() {
 		g_sURL = NULL;
 	}
 
+	if(g_hShare) {
+		curl_share_cleanup(g_hShare);
+		g_hShare = NULL;
+	}
+
 	curl_global_cleanup();
 }
 
@@ -151,12 +242,49 @@ static int8_t _fsrpc_parse_headers(struct fsrpc_request* pRequest, const char**
 	return 0;
 }
 
+static int8_t _fsrpc_build_key(struct fsrpc_request* pRequest, const char* sMethod, const char** aArguments, uintmax_t iMaxSize) {
+	size_t iSize = strlen(sMethod) + 1 + sizeof(iMaxSize);
+	for(const char** pArgument = aArguments; pArgument && *pArgument; ++pArgument) iSize += strlen(*pArgument) + 1;
+
+	char* pKey = malloc(iSize);
+	if(!pKey) return -1;
+
+	char* pCursor = stpcpy(pKey, sMethod) + 1;
+	memcpy(pCursor, &iMaxSize, sizeof(iMaxSize));
+	pCursor += sizeof(iMaxSize);
+
+	// Spans of coalesced requests are labelled with the path if there is one.
+	pRequest->sKeyPath = pKey;
+	for(const char** pArgument = aArguments; pArgument && *pArgument; ++pArgument) {
+		if(pArgument[1] && (pArgument - aArguments) % 2 == 0 && strcmp(*pArgument, "Path") == 0) pRequest->sKeyPath = pCursor + 5;
+		pCursor = stpcpy(pCursor, *pArgument) + 1;
+	}
+
+	pRequest->pKey = pKey;
+	pRequest->iKeySize = iSize;
+	return 0;
+}
+
+// The build span is labelled with the path the request is about, or with the
+// method if it has none.
+static const char* _TraceDetail(const char* sMethod, const char** aArguments) {
+	for(const char** pArgument = aArguments; pArgument && pArgument[0] && pArgument[1]; pArgument += 2) {
+		if(strcmp(pArgument[0], "Path") == 0) return pArgument[1];
+	}
+
+	return sMethod;
+}
+
 fsrpc_request_t fsrpc_create_request(const char* sMethod, const char** aArguments, uintmax_t iMaxSize, uint8_t xFlags) {
+	FSTRACE_SCOPE("build", _TraceDetail(sMethod, aArguments), 0, 0);
 	if(!g_sTokenHeader || !g_sURL) return NULL;
 
 	struct fsrpc_request* pRequest = calloc(1, sizeof(struct fsrpc_request));
 	if(!pRequest) return NULL;
 
+	pRequest->xFlags = xFlags;
+	pRequest->iLane = fssched_thread_lane(strcmp(sMethod, "READ") && strcmp(sMethod, "WRITE") ? FSSCHED_METADATA : FSSCHED_DATA);
+	pRequest->iCost = strcmp(sMethod, "READ") == 0 ? iMaxSize : METADATA_COST;
 	pRequest->tResponse.iMaxSize = iMaxSize;
 	if(xFlags & FSRPC_EXACT) {
 		if(!(pRequest->tResponse.pMemory = malloc(iMaxSize))) goto error;
@@ -169,6 +297,7 @@ fsrpc_request_t fsrpc_create_request(const char* sMethod, const char** aArgument
 		goto error;
 	}
 
+	if((xFlags & FSRPC_COALESCE) && _fsrpc_build_key(pRequest, sMethod, aArguments, iMaxSize)) goto error;
 	if(aArguments && _fsrpc_parse_headers(pRequest, aArguments)) goto error;
 	if(g_sTokenHeader && _fsrpc_add_header(pRequest, "Token", g_sTokenHeader)) goto error;
 	if(g_sRootHeader && _fsrpc_add_header(pRequest, "Root", g_sRootHeader)) goto error;
@@ -179,6 +308,8 @@ fsrpc_request_t fsrpc_create_request(const char* sMethod, const char** aArgument
 	if(curl_easy_setopt(pRequest->hRequest, CURLOPT_NOPROGRESS, !g_bDebug) != CURLE_OK) goto error;
 	if(curl_easy_setopt(pRequest->hRequest, CURLOPT_HTTPHEADER, pRequest->pHeaders) != CURLE_OK) goto error;
 	if(curl_easy_setopt(pRequest->hRequest, CURLOPT_VERBOSE, g_bDebug) != CURLE_OK) goto error;
+	if(g_hShare && curl_easy_setopt(pRequest->hRequest, CURLOPT_SHARE, g_hShare) != CURLE_OK) goto error;
+	if(g_iMaxConnections && curl_easy_setopt(pRequest->hRequest, CURLOPT_MAXCONNECTS, (long)g_iMaxConnections) != CURLE_OK) goto error;
 
 	if(curl_easy_setopt(pRequest->hRequest, CURLOPT_WRITEFUNCTION, curl_membuffer_writecb) != CURLE_OK) goto error;
 	if(curl_easy_setopt(pRequest->hRequest, CURLOPT_WRITEDATA, &pRequest->tResponse) != CURLE_OK) goto error;
@@ -196,6 +327,7 @@ fsrpc_request_t fsrpc_create_request(const char* sMethod, const char** aArgument
 int fsrpc_upload_buffer(fsrpc_request_t pRequest, const void* pData, uint64_t iSize) {
 	pRequest->tRequestBody.pMemory = (void*)pData;
 	pRequest->tRequestBody.iSize = iSize;
+	pRequest->iCost = iSize;
 
 	if(curl_easy_setopt(pRequest->hRequest, CURLOPT_UPLOAD, 1) != CURLE_OK) return -1;
 	if(curl_easy_setopt(pRequest->hRequest, CURLOPT_INFILESIZE_LARGE, (curl_off_t)iSize) != CURLE_OK) return -1;
@@ -206,11 +338,80 @@ int fsrpc_upload_buffer(fsrpc_request_t pRequest, const void* pData, uint64_t iS
 	return 0;
 }
 
-int fsrpc_perform_request(fsrpc_request_t pRequest) {
+static void _TraceTransfer(fsrpc_request_t pRequest, uint64_t iStart) {
+	uint64_t iEnd = fsstats_now();
+	char* sMethod = NULL;
+	curl_easy_getinfo(pRequest->hRequest, CURLINFO_EFFECTIVE_METHOD, &sMethod);
+	fstrace_record("network", sMethod, iStart, iEnd, pRequest->tRequestBody.iSize, pRequest->tResponse.iCursor);
+
+	// Split the transfer into its phases. curl reports each of them as the
+	// time elapsed since the start of the transfer, in microseconds.
+	static const struct {
+		const char* sName;
+		CURLINFO iInfo;
+	} aPhases[] = {
+		{ "dns", CURLINFO_NAMELOOKUP_TIME_T },
+		{ "connect", CURLINFO_CONNECT_TIME_T },
+		{ "tls", CURLINFO_APPCONNECT_TIME_T },
+		{ "setup", CURLINFO_PRETRANSFER_TIME_T },
+		{ "wait", CURLINFO_STARTTRANSFER_TIME_T },
+		{ "receive", CURLINFO_TOTAL_TIME_T },
+	};
+
+	curl_off_t iPrevious = 0;
+	for(size_t i = 0; i < sizeof(aPhases) / sizeof(*aPhases); ++i) {
+		curl_off_t iTime = 0;
+		if(curl_easy_getinfo(pRequest->hRequest, aPhases[i].iInfo, &iTime) != CURLE_OK || iTime <= iPrevious) continue;
+		fstrace_record(aPhases[i].sName, sMethod, iStart + iPrevious * 1000, iStart + iTime * 1000, 0, 0);
+		iPrevious = iTime;
+	}
+}
+
+static void _SetReady(int iStatus) {
+	pthread_mutex_lock(&g_tStateLock);
+	__atomic_store_n(&g_iReadyStatus, iStatus, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&g_tStateCondition);
+	pthread_mutex_unlock(&g_tStateLock);
+}
+
+static int _WaitReady() {
+	int iStatus = __atomic_load_n(&g_iReadyStatus, __ATOMIC_ACQUIRE);
+	if(iStatus != -EINPROGRESS) return iStatus;
+	FSTRACE_SCOPE("gate", NULL, 0, 0);
+
+	struct timespec tDeadline;
+	clock_gettime(CLOCK_REALTIME, &tDeadline);
+	tDeadline.tv_sec += READY_TIMEOUT;
+
+	pthread_mutex_lock(&g_tStateLock);
+	while(g_iReadyStatus == -EINPROGRESS && !g_bStopping) {
+		if(pthread_cond_timedwait(&g_tStateCondition, &g_tStateLock, &tDeadline) == ETIMEDOUT) break;
+	}
+
+	iStatus = g_iReadyStatus == -EINPROGRESS ? -ETIMEDOUT : g_iReadyStatus;
+	pthread_mutex_unlock(&g_tStateLock);
+	return iStatus;
+}
+
+static int _Perform(fsrpc_request_t pRequest) {
+	if(!(pRequest->xFlags & FSRPC_NO_GATE)) {
+		int iStatus = _WaitReady();
+		if(iStatus) return iStatus;
+	}
+
+	bool bSchedule = !(pRequest->xFlags & FSRPC_NO_SCHED);
+	FSSTATS_ADD(iRequests, 1);
+	if(bSchedule) fssched_acquire(pRequest->iLane, pRequest->iCost);
+	uint64_t iTrace = fstrace_begin();
 	CURLcode iError = curl_easy_perform(pRequest->hRequest);
+	if(iTrace) _TraceTransfer(pRequest, iTrace);
+	if(bSchedule) fssched_release(pRequest->iLane);
+	if(iError != CURLE_OK) FSSTATS_ADD(iRequestErrors, 1);
+
 	if(iError == CURLE_HTTP_RETURNED_ERROR) {
 		long iStatusCode = 0;
 		curl_easy_getinfo(pRequest->hRequest, CURLINFO_RESPONSE_CODE, &iStatusCode);
+		pRequest->iStatusCode = iStatusCode;
 		switch(iStatusCode) {
 			case 403: fprintf(stderr, "Invalid access token\n"); break;
 			default: fprintf(stderr, "HTTP error: %lu\n", iStatusCode);
@@ -230,21 +431,185 @@ void fsrpc_free_request(fsrpc_request_t pRequest) {
 	if(pRequest->pHeaders) curl_slist_free_all(pRequest->pHeaders);
 	if(pRequest->hRequest) curl_easy_cleanup(pRequest->hRequest);
 	if(pRequest->tResponse.pMemory) free(pRequest->tResponse.pMemory);
+	if(pRequest->pKey) free(pRequest->pKey);
 	free(pRequest);
 }
 
+static int _CopyResponse(fsrpc_request_t pRequest, const void* pData, uintmax_t iSize) {
+	struct membuffer* pBuffer = &pRequest->tResponse;
+	if(iSize > pBuffer->iMaxSize) return -ECONNRESET;
+
+	if(iSize > pBuffer->iSize) {
+		void* pMemory = realloc(pBuffer->pMemory, iSize);
+		if(!pMemory) return -ENOMEM;
+		pBuffer->pMemory = pMemory;
+		pBuffer->iSize = iSize;
+	}
+
+	if(iSize) memcpy(pBuffer->pMemory, pData, iSize);
+	pBuffer->iCursor = iSize;
+	return 0;
+}
+
+static int _PerformShared(fsrpc_request_t pRequest) {
+	pthread_mutex_lock(&g_tFlightLock);
+	struct flight* pFlight = g_pFlights;
+	while(pFlight && (pFlight->iGeneration != pRequest->iGeneration || pFlight->iKeySize != pRequest->iKeySize || memcmp(pFlight->pKey, pRequest->pKey, pRequest->iKeySize))) pFlight = pFlight->pNext;
+
+	if(pFlight) {
+		++pFlight->iFollowers;
+		FSTRACE_SCOPE("coalesce", pRequest->sKeyPath, 0, 0);
+		while(!pFlight->bDone) pthread_cond_wait(&pFlight->tCondition, &g_tFlightLock);
+
+		int iStatus = pFlight->iStatus;
+		pRequest->iStatusCode = pFlight->iStatusCode;
+		if(!iStatus) iStatus = _CopyResponse(pRequest, pFlight->pResponse, pFlight->iResponseSize);
+
+		if(!--pFlight->iFollowers) {
+			pthread_cond_destroy(&pFlight->tCondition);
+			free(pFlight->pResponse);
+			free(pFlight);
+		}
+
+		pthread_mutex_unlock(&g_tFlightLock);
+		FSSTATS_ADD(iCoalescedRequests, 1);
+		return iStatus;
+	}
+
+	pFlight = calloc(1, sizeof(struct flight));
+	if(!pFlight) {
+		pthread_mutex_unlock(&g_tFlightLock);
+		return _Perform(pRequest);
+	}
+
+	pFlight->pKey = pRequest->pKey;
+	pFlight->iKeySize = pRequest->iKeySize;
+	pFlight->iGeneration = pRequest->iGeneration;
+	pthread_cond_init(&pFlight->tCondition, NULL);
+	pFlight->pNext = g_pFlights;
+	g_pFlights = pFlight;
+	pthread_mutex_unlock(&g_tFlightLock);
+
+	int iStatus = _Perform(pRequest);
+
+	pthread_mutex_lock(&g_tFlightLock);
+	struct flight** ppFlight = &g_pFlights;
+	while(*ppFlight != pFlight) ppFlight = &(*ppFlight)->pNext;
+	*ppFlight = pFlight->pNext;
+
+	if(!pFlight->iFollowers) {
+		pthread_mutex_unlock(&g_tFlightLock);
+		pthread_cond_destroy(&pFlight->tCondition);
+		free(pFlight);
+		return iStatus;
+	}
+
+	pFlight->iStatus = iStatus;
+	pFlight->iStatusCode = pRequest->iStatusCode;
+	if(!iStatus) {
+		pFlight->iResponseSize = pRequest->tResponse.iCursor;
+		pFlight->pResponse = malloc(pFlight->iResponseSize ? pFlight->iResponseSize : 1);
+		if(pFlight->pResponse) memcpy(pFlight->pResponse, pRequest->tResponse.pMemory, pFlight->iResponseSize);
+		else pFlight->iStatus = -ENOMEM;
+	}
+
+	pFlight->bDone = true;
+	pthread_cond_broadcast(&pFlight->tCondition);
+	pthread_mutex_unlock(&g_tFlightLock);
+	return iStatus;
+}
+
+int fsrpc_perform_request(fsrpc_request_t pRequest) {
+	if(pRequest->pKey) return _PerformShared(pRequest);
+	return _Perform(pRequest);
+}
+
 int fsrpc_connect() {
-	fsrpc_request_t pRequest = fsrpc_create_request("INIT", NULL, 512 * 1024, 0);
+	fsrpc_request_t pRequest = fsrpc_create_request("INIT", NULL, 512 * 1024, FSRPC_NO_GATE);
 	if(!pRequest) return -ENOMEM;
 
 	int iStatus = fsrpc_perform_request(pRequest);
+	if(!iStatus) _SetReady(0);
 
 	fsrpc_free_request(pRequest);
 	return iStatus;
 }
 
+static void* _Prewarm(void* pArgument) {
+	fssched_set_thread_lane(FSSCHED_BACKGROUND);
+	fsrpc_request_t pRequest = fsrpc_create_request("STATVFS", (const char*[]){ "Format", "binary-le-1", NULL }, 64 * 1024, 0);
+	if(pRequest) {
+		fsrpc_perform_request(pRequest);
+		fsrpc_free_request(pRequest);
+	}
+
+	return NULL;
+}
+
+static void* _Background(void* pArgument) {
+	for(uint32_t iDelay = 1; g_bAsync; iDelay = iDelay * 2 < MAX_RETRY_DELAY ? iDelay * 2 : MAX_RETRY_DELAY) {
+		fsrpc_request_t pRequest = fsrpc_create_request("INIT", NULL, 512 * 1024, FSRPC_NO_GATE);
+		if(pRequest) curl_easy_setopt(pRequest->hRequest, CURLOPT_CONNECTTIMEOUT, (long)INIT_CONNECT_TIMEOUT);
+
+		int iStatus = pRequest ? fsrpc_perform_request(pRequest) : -ENOMEM;
+		long iStatusCode = pRequest ? pRequest->iStatusCode : 0;
+		if(pRequest) fsrpc_free_request(pRequest);
+
+		if(!iStatus) {
+			_SetReady(0);
+			break;
+		}
+
+		if(iStatusCode == 401 || iStatusCode == 403) {
+			_SetReady(-EACCES);
+			return NULL;
+		}
+
+		fprintf(stderr, "INIT failed, retrying in %u s\n", iDelay);
+
+		struct timespec tDeadline;
+		clock_gettime(CLOCK_REALTIME, &tDeadline);
+		tDeadline.tv_sec += iDelay;
+
+		pthread_mutex_lock(&g_tStateLock);
+		while(!g_bStopping && pthread_cond_timedwait(&g_tStateCondition, &g_tStateLock, &tDeadline) != ETIMEDOUT);
+		bool bStopping = g_bStopping;
+		pthread_mutex_unlock(&g_tStateLock);
+		if(bStopping) return NULL;
+	}
+
+	// Open the rest of the pool with concurrent requests, each of which has
+	// to establish a connection of its own.
+	pthread_t aThreads[g_iConnections ? g_iConnections : 1];
+	uint32_t iStarted = 0;
+	while(iStarted < g_iConnections && pthread_create(&aThreads[iStarted], NULL, _Prewarm, NULL) == 0) ++iStarted;
+	while(iStarted) pthread_join(aThreads[--iStarted], NULL);
+	return NULL;
+}
+
+int8_t fsrpc_start() {
+	if(!g_bAsync && !g_iConnections) return 0;
+	if(pthread_create(&g_hBackground, NULL, _Background, NULL)) return -1;
+	g_bBackground = true;
+	return 0;
+}
+
+void fsrpc_stop() {
+	pthread_mutex_lock(&g_tStateLock);
+	g_bStopping = true;
+	pthread_cond_broadcast(&g_tStateCondition);
+	pthread_mutex_unlock(&g_tStateLock);
+
+	if(g_bBackground) {
+		pthread_join(g_hBackground, NULL);
+		g_bBackground = false;
+	}
+}
+
 void fsrpc_disconnect() {
-	fsrpc_request_t pRequest = fsrpc_create_request("DESTROY", NULL, 0, 0);
+	if(__atomic_load_n(&g_iReadyStatus, __ATOMIC_ACQUIRE)) return;
+
+	fsrpc_request_t pRequest = fsrpc_create_request("DESTROY", NULL, 0, FSRPC_NO_GATE);
 	if(pRequest) {
 		fsrpc_perform_request(pRequest);
 		fsrpc_free_request(pRequest);
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <curl/curl.h>
+#include "wire.h"
 
 struct membuffer {
 	void* pMemory;
@@ -12,56 +13,25 @@ struct membuffer {
 
 enum fsrpc_create_flags {
 	FSRPC_EXACT = 1 << 0,
+	FSRPC_NO_GATE = 1 << 1,
+	FSRPC_COALESCE = 1 << 2,
+	FSRPC_NO_SCHED = 1 << 3,
 };
 
-struct fsrpc_timespec {
-	uint64_t iSeconds;
-	uint64_t iNanoseconds;
-};
-
-#pragma pack(push, 1)
-typedef struct fsrpc_stat {
-	uint64_t iSize;
-	struct fsrpc_timespec tAccessTime;
-	struct fsrpc_timespec tModificationTime;
-	struct fsrpc_timespec tMetadataChangeTime;
-	struct fsrpc_timespec tCreateTime;
-	uint32_t iMappedUser;
-	uint32_t iMappedGroup;
-	uint16_t xPermissionBits;
-	uint8_t iType;
-} *fsrpc_stat_t;
-
-typedef struct fsrpc_dirent {
-	uint64_t iSize;
-	struct fsrpc_timespec tAccessTime;
-	struct fsrpc_timespec tModificationTime;
-	struct fsrpc_timespec tMetadataChangeTime;
-	struct fsrpc_timespec tCreateTime;
-	uint32_t iMappedUser;
-	uint32_t iMappedGroup;
-	uint16_t xPermissionBits;
-	uint8_t iType;
-	uint8_t iNameSize;
-	char sName[0];
-} *fsrpc_dirent_t;
-
-typedef struct fsrpc_statvfs {
-	uint64_t iTotalSpace;
-	uint64_t iFreeSpace;
-
-	uint64_t iTotalInodes;
-	uint64_t iFreeInodes;
-} *fsrpc_statvfs_t;
-#pragma pack(pop)
-//_Static_assert(sizeof(struct fsrpc_dirent) % 8 == 0);
-
 typedef struct fsrpc_request {
 	struct curl_slist* pHeaders;
 	CURL* hRequest;
 
 	struct membuffer tRequestBody;
 	struct membuffer tResponse;
+	long iStatusCode;
+	uint8_t xFlags;
+	uint8_t iLane;
+	uint64_t iCost;
+	char* pKey;
+	size_t iKeySize;
+	const char* sKeyPath;
+	uint64_t iGeneration;
 } *fsrpc_request_t;
 
 struct uint32_str { char s[10 + 1]; };
@@ -84,8 +54,12 @@ static inline struct uint64_str uint64_str(uint64_t iValue) {
 
 int8_t fsrpc_set_token(const char* sToken);
 int8_t fsrpc_set_root(const char* sRoot);
+const char* fsrpc_get_root();
 int8_t fsrpc_set_endpoint(const char* sEndpoint);
 void fsrpc_set_debug(bool bDebug);
+void fsrpc_set_async(bool bAsync);
+void fsrpc_set_connections(uint32_t iConnections);
+void fsrpc_set_max_connections(uint32_t iMaxConnections);
 int8_t fsrpc_init();
 void fsrpc_cleanup();
 fsrpc_request_t fsrpc_create_request(const char* sMethod, const char** aHeaders, uintmax_t iMaxSize, uint8_t xFlags);
@@ -93,5 +67,7 @@ int fsrpc_upload_buffer(fsrpc_request_t pRequest, const void* pData, uint64_t iS
 int fsrpc_perform_request(fsrpc_request_t pRequest);
 void fsrpc_free_request(fsrpc_request_t pRequest);
 int fsrpc_connect();
+int8_t fsrpc_start();
+void fsrpc_stop();
 void fsrpc_disconnect();
 int fsrpc_errno(uint8_t iError);
@@ -0,0 +1,156 @@
+#include "sched.h"
+#include "stats.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+// Requests are admitted by weighted fair queuing. Each waiter is tagged with
+// a virtual finish time of max(now, previous finish in its lane) + cost /
+// weight and the smallest tag among the lanes that are below their limits
+// goes first. Data and background requests together can only take the slots
+// outside a reserve kept for metadata, so a metadata request only ever waits
+// for other metadata requests, never for bulk transfers.
+struct waiter {
+	struct waiter* pNext;
+	uint64_t iTag;
+	bool bGranted;
+	pthread_cond_t tCondition;
+};
+
+struct lane {
+	const char* sName;
+	uint32_t iWeight;
+	uint32_t iLimit;
+	uint32_t iActive;
+	uint64_t iFinish;
+	struct waiter* pHead;
+	struct waiter* pTail;
+};
+
+static pthread_mutex_t g_tLock = PTHREAD_MUTEX_INITIALIZER;
+static struct lane g_aLanes[FSSCHED_LANES] = {
+	[FSSCHED_METADATA] = { "metadata", 16 },
+	[FSSCHED_DATA] = { "data", 4 },
+	[FSSCHED_BACKGROUND] = { "background", 1 },
+};
+
+static uint32_t g_iMaxActive = 0;
+static uint32_t g_iActive = 0;
+static uint32_t g_iBulkLimit = 0;
+static uint32_t g_iBulkActive = 0;
+static uint64_t g_iVirtualTime = 0;
+static __thread enum fssched_lane t_iLane = FSSCHED_LANES;
+
+static bool _HasRoom(enum fssched_lane iLane) {
+	if(g_aLanes[iLane].iActive >= g_aLanes[iLane].iLimit) return false;
+	return iLane == FSSCHED_METADATA || g_iBulkActive < g_iBulkLimit;
+}
+
+static void _Admit(enum fssched_lane iLane) {
+	++g_aLanes[iLane].iActive;
+	++g_iActive;
+	if(iLane != FSSCHED_METADATA) ++g_iBulkActive;
+}
+
+static void _Dispatch() {
+	while(g_iActive < g_iMaxActive) {
+		struct lane* pNext = NULL;
+		for(int i = 0; i < FSSCHED_LANES; ++i) {
+			struct lane* pLane = &g_aLanes[i];
+			if(!pLane->pHead || !_HasRoom(i)) continue;
+			if(!pNext || pLane->pHead->iTag < pNext->pHead->iTag) pNext = pLane;
+		}
+
+		if(!pNext) break;
+
+		struct waiter* pWaiter = pNext->pHead;
+		pNext->pHead = pWaiter->pNext;
+		if(!pNext->pHead) pNext->pTail = NULL;
+
+		_Admit(pNext - g_aLanes);
+		if(pWaiter->iTag > g_iVirtualTime) g_iVirtualTime = pWaiter->iTag;
+		pWaiter->bGranted = true;
+		pthread_cond_signal(&pWaiter->tCondition);
+	}
+}
+
+// ===================================================
+
+// An eighth of the slots, and at least one, is reserved for metadata. The
+// background lane gets at most a quarter of the remaining bulk slots, data
+// may use all of them.
+void fssched_configure(uint32_t iMaxActive) {
+	if(iMaxActive == 1) iMaxActive = 2;
+	uint32_t iReserve = iMaxActive / 8 ? iMaxActive / 8 : 1;
+	g_iMaxActive = iMaxActive;
+	g_iBulkLimit = iMaxActive - iReserve;
+
+	g_aLanes[FSSCHED_METADATA].iLimit = iMaxActive;
+	g_aLanes[FSSCHED_DATA].iLimit = g_iBulkLimit;
+	g_aLanes[FSSCHED_BACKGROUND].iLimit = g_iBulkLimit / 4 ? g_iBulkLimit / 4 : 1;
+}
+
+void fssched_set_thread_lane(enum fssched_lane iLane) {
+	t_iLane = iLane;
+}
+
+enum fssched_lane fssched_thread_lane(enum fssched_lane iDefault) {
+	return t_iLane < FSSCHED_LANES ? t_iLane : iDefault;
+}
+
+void fssched_acquire(enum fssched_lane iLane, uint64_t iCost) {
+	if(!g_iMaxActive) return;
+	struct lane* pLane = &g_aLanes[iLane];
+	FSSTATS_ADD(aLaneRequests[iLane], 1);
+
+	pthread_mutex_lock(&g_tLock);
+	uint64_t iStart = pLane->iFinish > g_iVirtualTime ? pLane->iFinish : g_iVirtualTime;
+	pLane->iFinish = iStart + (iCost ? iCost : 1) * 16 / pLane->iWeight;
+
+	if(g_iActive < g_iMaxActive && _HasRoom(iLane)) {
+		_Admit(iLane);
+		if(iStart > g_iVirtualTime) g_iVirtualTime = iStart;
+		pthread_mutex_unlock(&g_tLock);
+		return;
+	}
+
+	uint64_t iWaitStart = fsstats_now();
+	struct waiter tWaiter = { NULL, pLane->iFinish, false };
+	pthread_cond_init(&tWaiter.tCondition, NULL);
+	if(pLane->pTail) pLane->pTail->pNext = &tWaiter;
+	else pLane->pHead = &tWaiter;
+	pLane->pTail = &tWaiter;
+
+	FSSTATS_ADD(aLaneQueued[iLane], 1);
+	while(!tWaiter.bGranted) pthread_cond_wait(&tWaiter.tCondition, &g_tLock);
+	pthread_mutex_unlock(&g_tLock);
+	pthread_cond_destroy(&tWaiter.tCondition);
+
+	uint64_t iWaitEnd = fsstats_now();
+	FSSTATS_ADD(aLaneWaitTime[iLane], iWaitEnd - iWaitStart);
+	if(__atomic_load_n(&g_bTraceEnabled, __ATOMIC_RELAXED)) fstrace_record("queue", pLane->sName, iWaitStart, iWaitEnd, 0, iCost);
+}
+
+// Bills an admitted request for work it took on after it was admitted, such
+// as a read that was widened while it waited. The lane's later requests are
+// tagged as if the cost had been known up front.
+void fssched_charge(enum fssched_lane iLane, uint64_t iCost) {
+	if(!g_iMaxActive) return;
+	struct lane* pLane = &g_aLanes[iLane];
+
+	pthread_mutex_lock(&g_tLock);
+	uint64_t iStart = pLane->iFinish > g_iVirtualTime ? pLane->iFinish : g_iVirtualTime;
+	pLane->iFinish = iStart + iCost * 16 / pLane->iWeight;
+	pthread_mutex_unlock(&g_tLock);
+}
+
+void fssched_release(enum fssched_lane iLane) {
+	if(!g_iMaxActive) return;
+
+	pthread_mutex_lock(&g_tLock);
+	--g_aLanes[iLane].iActive;
+	--g_iActive;
+	if(iLane != FSSCHED_METADATA) --g_iBulkActive;
+	_Dispatch();
+	pthread_mutex_unlock(&g_tLock);
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+enum fssched_lane {
+	FSSCHED_METADATA,
+	FSSCHED_DATA,
+	FSSCHED_BACKGROUND,
+	FSSCHED_LANES,
+};
+
+void fssched_configure(uint32_t iMaxActive);
+void fssched_set_thread_lane(enum fssched_lane iLane);
+enum fssched_lane fssched_thread_lane(enum fssched_lane iDefault);
+void fssched_acquire(enum fssched_lane iLane, uint64_t iCost);
+void fssched_charge(enum fssched_lane iLane, uint64_t iCost);
+void fssched_release(enum fssched_lane iLane);
@@ -0,0 +1,282 @@
+#include "shared.h"
+#include "stats.h"
+#include "os.h"
+#include <time.h>
+#include <sys/mman.h>
+#include <inttypes.h>
+
+#define MAGIC 0x32434448 // "HDC2"
+#define BUCKETS 16384
+#define WAYS 4
+#define STRIPES 256
+#define GENERATIONS 65536
+#define ATTACH_TIMEOUT_MS 2000
+#define CHECK_SEED 0x9e3779b97f4a7c15
+
+// Attributes are shared between the mounts of one host through a fixed size,
+// set associative table in POSIX shared memory. Entries are keyed by two
+// independent hashes of the account and remote path (root + path), so mounts
+// of different roots find each other's entries for the paths they have in
+// common, while mounts of different accounts never do. Invalidations bump a
+// shared generation per path that the mounts fold into their own cache
+// generations, so a change made through one mount also ends what the others
+// cached locally. Each stripe of buckets is guarded by a process shared robust
+// mutex. A process that dies while holding one leaves the stripe to be cleared
+// by the next owner, which is safe because everything in the table can be
+// fetched again.
+
+struct shared_entry {
+	uint64_t iKey;
+	uint64_t iCheck;
+	uint64_t iExpires;
+	uint64_t iGeneration;
+	uint64_t iSize;
+	int64_t iSeconds;
+	uint32_t iNanoseconds;
+	uint32_t xMode;
+};
+
+struct shared_table {
+	uint32_t iMagic;
+	uint32_t iBuckets;
+	pthread_mutex_t aLocks[STRIPES];
+	uint64_t aGenerations[GENERATIONS];
+	struct shared_entry aEntries[BUCKETS * WAYS];
+};
+
+static struct shared_table* g_pTable = NULL;
+static char* g_sPrefix = NULL;
+static uint32_t g_iTTL = 0;
+
+static time_t _Now() {
+	struct timespec tNow;
+	clock_gettime(CLOCK_MONOTONIC, &tNow);
+	return tNow.tv_sec;
+}
+
+static uint64_t _Key(const char* sPath, uint64_t iSeed) {
+	uint64_t iHash = 0xcbf29ce484222325 ^ iSeed;
+	for(const char* sPart = g_sPrefix ? g_sPrefix : ""; *sPart; ++sPart) {
+		iHash ^= (uint8_t)*sPart;
+		iHash *= 0x100000001b3;
+	}
+
+	for(; *sPath; ++sPath) {
+		iHash ^= (uint8_t)*sPath;
+		iHash *= 0x100000001b3;
+	}
+
+	return iHash;
+}
+
+static void _Lock(uint32_t iBucket) {
+	uint32_t iStripe = iBucket % STRIPES;
+	if(pthread_mutex_lock(&g_pTable->aLocks[iStripe]) != EOWNERDEAD) return;
+
+	for(uint32_t i = iStripe; i < BUCKETS; i += STRIPES) memset(&g_pTable->aEntries[i * WAYS], 0, WAYS * sizeof(struct shared_entry));
+	pthread_mutex_consistent(&g_pTable->aLocks[iStripe]);
+}
+
+static void _Unlock(uint32_t iBucket) {
+	pthread_mutex_unlock(&g_pTable->aLocks[iBucket % STRIPES]);
+}
+
+static struct shared_entry* _Find(uint32_t iBucket, uint64_t iKey, uint64_t iCheck) {
+	struct shared_entry* pEntry = &g_pTable->aEntries[iBucket * WAYS];
+	for(uint32_t i = 0; i < WAYS; ++i, ++pEntry) {
+		if(pEntry->iKey == iKey && pEntry->iCheck == iCheck) return pEntry;
+	}
+
+	return NULL;
+}
+
+// ===================================================
+
+static int8_t _Initialize(struct shared_table* pTable) {
+	pthread_mutexattr_t tAttributes;
+	if(pthread_mutexattr_init(&tAttributes)) return -1;
+	pthread_mutexattr_setpshared(&tAttributes, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&tAttributes, PTHREAD_MUTEX_ROBUST);
+
+	int8_t iStatus = 0;
+	for(uint32_t i = 0; i < STRIPES && !iStatus; ++i) {
+		if(pthread_mutex_init(&pTable->aLocks[i], &tAttributes)) iStatus = -1;
+	}
+
+	pthread_mutexattr_destroy(&tAttributes);
+	pTable->iBuckets = BUCKETS;
+	if(!iStatus) __atomic_store_n(&pTable->iMagic, MAGIC, __ATOMIC_RELEASE);
+	return iStatus;
+}
+
+int8_t fsshared_configure(const char* sName, const char* sAccount, const char* sRoot, uint32_t iTTL) {
+	if(!sName) return 0;
+	if(!*sName || strchr(sName, '/')) {
+		fprintf(stderr, "Invalid shared cache name: %s\n", sName);
+		return -1;
+	}
+
+	char sObject[NAME_MAX];
+	if(snprintf(sObject, sizeof(sObject), "/hexalinq-drive.%s", sName) >= (int)sizeof(sObject)) return -1;
+
+	// The first mount creates and initializes the table, the others wait
+	// until it is ready.
+	bool bCreator = true;
+	int iFD = shm_open(sObject, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if(iFD < 0 && errno == EEXIST) {
+		bCreator = false;
+		iFD = shm_open(sObject, O_RDWR | O_CLOEXEC, 0);
+	}
+
+	if(iFD < 0) {
+		perror("shm_open");
+		return -1;
+	}
+
+	if(bCreator && ftruncate(iFD, sizeof(struct shared_table))) {
+		perror("ftruncate");
+		close(iFD);
+		shm_unlink(sObject);
+		return -1;
+	}
+
+	struct stat tStat;
+	for(uint32_t i = 0; !bCreator && !fstat(iFD, &tStat) && tStat.st_size == 0 && i < ATTACH_TIMEOUT_MS; ++i) usleep(1000);
+	if(fstat(iFD, &tStat) || (size_t)tStat.st_size != sizeof(struct shared_table)) {
+		fprintf(stderr, "Shared cache %s has an unexpected size, remove %s from /dev/shm\n", sName, sObject + 1);
+		close(iFD);
+		return -1;
+	}
+
+	struct shared_table* pTable = mmap(NULL, sizeof(struct shared_table), PROT_READ | PROT_WRITE, MAP_SHARED, iFD, 0);
+	close(iFD);
+	if(pTable == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	if(bCreator && _Initialize(pTable)) {
+		munmap(pTable, sizeof(struct shared_table));
+		shm_unlink(sObject);
+		return -1;
+	}
+
+	for(uint32_t i = 0; __atomic_load_n(&pTable->iMagic, __ATOMIC_ACQUIRE) != MAGIC && i < ATTACH_TIMEOUT_MS; ++i) usleep(1000);
+	if(pTable->iMagic != MAGIC || pTable->iBuckets != BUCKETS) {
+		fprintf(stderr, "Shared cache %s is not initialized, remove %s from /dev/shm\n", sName, sObject + 1);
+		munmap(pTable, sizeof(struct shared_table));
+		return -1;
+	}
+
+	// The account enters the keys as a hash, the token itself is not kept.
+	uint64_t iAccount = _Key(sAccount ? sAccount : "", 0);
+	size_t iLength = sRoot ? strlen(sRoot) : 0;
+	while(iLength && sRoot[iLength - 1] == '/') --iLength;
+	if(!(g_sPrefix = malloc(16 + 1 + iLength + 1))) {
+		munmap(pTable, sizeof(struct shared_table));
+		return -1;
+	}
+
+	sprintf(g_sPrefix, "%016" PRIx64 ":%.*s", iAccount, (int)iLength, sRoot ? sRoot : "");
+	g_pTable = pTable;
+	g_iTTL = iTTL;
+	return 0;
+}
+
+void fsshared_cleanup() {
+	if(!g_pTable) return;
+	munmap(g_pTable, sizeof(struct shared_table));
+	g_pTable = NULL;
+	free(g_sPrefix);
+	g_sPrefix = NULL;
+}
+
+bool fsshared_enabled() {
+	return g_pTable != NULL;
+}
+
+uint64_t fsshared_generation(const char* sPath) {
+	if(!g_pTable) return 0;
+	return __atomic_load_n(&g_pTable->aGenerations[_Key(sPath, 0) % GENERATIONS], __ATOMIC_ACQUIRE);
+}
+
+bool fsshared_get_stat(const char* sPath, struct stat* pOutput, uint32_t* pRemaining) {
+	if(!g_pTable || !g_iTTL) return false;
+
+	uint64_t iKey = _Key(sPath, 0);
+	uint64_t iCheck = _Key(sPath, CHECK_SEED);
+	uint32_t iBucket = iKey % BUCKETS;
+	uint64_t iGeneration = __atomic_load_n(&g_pTable->aGenerations[iKey % GENERATIONS], __ATOMIC_ACQUIRE);
+	time_t iNow = _Now();
+
+	_Lock(iBucket);
+	struct shared_entry* pEntry = _Find(iBucket, iKey, iCheck);
+	bool bHit = pEntry && pEntry->iExpires > (uint64_t)iNow && pEntry->iGeneration == iGeneration;
+	struct shared_entry tEntry;
+	if(bHit) tEntry = *pEntry;
+	_Unlock(iBucket);
+
+	if(!bHit) {
+		FSSTATS_ADD(iSharedStatMisses, 1);
+		return false;
+	}
+
+	memset(pOutput, 0, sizeof(struct stat));
+	pOutput->st_mode = tEntry.xMode;
+	pOutput->st_nlink = 2;
+	pOutput->st_size = tEntry.iSize;
+	pOutput->st_blocks = (tEntry.iSize + 511) / 512;
+	pOutput->st_mtim.tv_sec = tEntry.iSeconds;
+	pOutput->st_mtim.tv_nsec = tEntry.iNanoseconds;
+	*pRemaining = tEntry.iExpires - iNow;
+	FSSTATS_ADD(iSharedStatHits, 1);
+	return true;
+}
+
+// The generation is the one the attributes were fetched under, an entry put
+// after the path was invalidated is never returned.
+void fsshared_put_stat(const char* sPath, const struct stat* pStat, uint64_t iGeneration) {
+	if(!g_pTable || !g_iTTL) return;
+
+	uint64_t iKey = _Key(sPath, 0);
+	uint64_t iCheck = _Key(sPath, CHECK_SEED);
+	uint32_t iBucket = iKey % BUCKETS;
+
+	_Lock(iBucket);
+	struct shared_entry* pEntry = _Find(iBucket, iKey, iCheck);
+	if(!pEntry) {
+		// Replace the entry closest to expiring, empty ones first.
+		pEntry = &g_pTable->aEntries[iBucket * WAYS];
+		for(uint32_t i = 1; i < WAYS; ++i) {
+			struct shared_entry* pCandidate = &g_pTable->aEntries[iBucket * WAYS + i];
+			if(pCandidate->iExpires < pEntry->iExpires) pEntry = pCandidate;
+		}
+	}
+
+	*pEntry = (struct shared_entry){
+		.iKey = iKey,
+		.iCheck = iCheck,
+		.iExpires = _Now() + g_iTTL,
+		.iGeneration = iGeneration,
+		.iSize = pStat->st_size,
+		.iSeconds = pStat->st_mtim.tv_sec,
+		.iNanoseconds = pStat->st_mtim.tv_nsec,
+		.xMode = pStat->st_mode,
+	};
+
+	_Unlock(iBucket);
+}
+
+void fsshared_invalidate(const char* sPath) {
+	if(!g_pTable) return;
+
+	uint64_t iKey = _Key(sPath, 0);
+	uint64_t iCheck = _Key(sPath, CHECK_SEED);
+	uint32_t iBucket = iKey % BUCKETS;
+	__atomic_add_fetch(&g_pTable->aGenerations[iKey % GENERATIONS], 1, __ATOMIC_RELEASE);
+
+	_Lock(iBucket);
+	struct shared_entry* pEntry = _Find(iBucket, iKey, iCheck);
+	if(pEntry) memset(pEntry, 0, sizeof(struct shared_entry));
+	_Unlock(iBucket);
+}
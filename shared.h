@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+int8_t fsshared_configure(const char* sName, const char* sAccount, const char* sRoot, uint32_t iTTL);
+void fsshared_cleanup();
+bool fsshared_enabled();
+uint64_t fsshared_generation(const char* sPath);
+bool fsshared_get_stat(const char* sPath, struct stat* pOutput, uint32_t* pRemaining);
+void fsshared_put_stat(const char* sPath, const struct stat* pStat, uint64_t iGeneration);
+void fsshared_invalidate(const char* sPath);
@@ -0,0 +1,73 @@
+#include "stats.h"
+#include <stdio.h>
+#include <time.h>
+
+struct fsstats g_tStats;
+
+#define COUNTER(s, p) { s, offsetof(struct fsstats, p) }
+static const struct {
+	const char* sName;
+	size_t iOffset;
+} g_aCounters[] = {
+	COUNTER("requests", iRequests),
+	COUNTER("request_errors", iRequestErrors),
+	COUNTER("coalesced_requests", iCoalescedRequests),
+	COUNTER("merged_reads", iMergedReads),
+	COUNTER("bytes_read", iBytesRead),
+	COUNTER("bytes_written", iBytesWritten),
+	COUNTER("stat_cache_hits", iStatHits),
+	COUNTER("stat_cache_misses", iStatMisses),
+	COUNTER("data_cache_hits", iDataHits),
+	COUNTER("data_cache_misses", iDataMisses),
+	COUNTER("cache_entries", iCacheEntries),
+	COUNTER("cache_bytes", iCacheBytes),
+	COUNTER("shared_stat_hits", iSharedStatHits),
+	COUNTER("shared_stat_misses", iSharedStatMisses),
+	COUNTER("shared_block_hits", iSharedBlockHits),
+	COUNTER("shared_block_fetches", iSharedBlockFetches),
+	COUNTER("warmup_running", bWarmupRunning),
+	COUNTER("warmup_runs", iWarmupRuns),
+	COUNTER("warmup_dirs_queued", iWarmupDirsQueued),
+	COUNTER("warmup_dirs_done", iWarmupDirsDone),
+	COUNTER("warmup_files", iWarmupFiles),
+	COUNTER("warmup_files_prefetched", iWarmupFilesPrefetched),
+	COUNTER("warmup_bytes_prefetched", iWarmupBytesPrefetched),
+	COUNTER("warmup_errors", iWarmupErrors),
+	COUNTER("lane_metadata_requests", aLaneRequests[0]),
+	COUNTER("lane_metadata_queued", aLaneQueued[0]),
+	COUNTER("lane_metadata_wait_ns", aLaneWaitTime[0]),
+	COUNTER("lane_data_requests", aLaneRequests[1]),
+	COUNTER("lane_data_queued", aLaneQueued[1]),
+	COUNTER("lane_data_wait_ns", aLaneWaitTime[1]),
+	COUNTER("lane_background_requests", aLaneRequests[2]),
+	COUNTER("lane_background_queued", aLaneQueued[2]),
+	COUNTER("lane_background_wait_ns", aLaneWaitTime[2]),
+};
+
+uint64_t fsstats_now() {
+	struct timespec tNow;
+	clock_gettime(CLOCK_MONOTONIC, &tNow);
+	return (uint64_t)tNow.tv_sec * 1000000000 + tNow.tv_nsec;
+}
+
+size_t fsstats_format(char* sBuffer, size_t iSize) {
+	size_t iLength = 0;
+
+	#define APPEND(fmt, ...) do { \
+		int iWritten = snprintf(sBuffer + iLength, iSize - iLength, fmt, ##__VA_ARGS__); \
+		if(iWritten < 0 || (size_t)iWritten >= iSize - iLength) return iLength; \
+		iLength += iWritten; \
+	} while(0)
+
+	for(size_t i = 0; i < sizeof(g_aCounters) / sizeof(*g_aCounters); ++i) {
+		uint64_t* pCounter = (void*)&g_tStats + g_aCounters[i].iOffset;
+		APPEND("%s %lu\n", g_aCounters[i].sName, __atomic_load_n(pCounter, __ATOMIC_RELAXED));
+	}
+
+	uint64_t iWarmupStart = FSSTATS_GET(iWarmupStartTime);
+	uint64_t iWarmupEnd = FSSTATS_GET(bWarmupRunning) ? fsstats_now() : FSSTATS_GET(iWarmupEndTime);
+	APPEND("warmup_elapsed_ms %lu\n", iWarmupStart && iWarmupEnd > iWarmupStart ? (iWarmupEnd - iWarmupStart) / 1000000 : 0);
+
+	#undef APPEND
+	return iLength;
+}
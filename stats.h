@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+struct fsstats {
+	uint64_t iRequests;
+	uint64_t iRequestErrors;
+	uint64_t iCoalescedRequests;
+	uint64_t iMergedReads;
+	uint64_t iBytesRead;
+	uint64_t iBytesWritten;
+
+	uint64_t iStatHits;
+	uint64_t iStatMisses;
+	uint64_t iDataHits;
+	uint64_t iDataMisses;
+	uint64_t iCacheEntries;
+	uint64_t iCacheBytes;
+	uint64_t iSharedStatHits;
+	uint64_t iSharedStatMisses;
+	uint64_t iSharedBlockHits;
+	uint64_t iSharedBlockFetches;
+
+	uint64_t bWarmupRunning;
+	uint64_t iWarmupRuns;
+	uint64_t iWarmupDirsQueued;
+	uint64_t iWarmupDirsDone;
+	uint64_t iWarmupFiles;
+	uint64_t iWarmupFilesPrefetched;
+	uint64_t iWarmupBytesPrefetched;
+	uint64_t iWarmupErrors;
+	uint64_t iWarmupStartTime;
+	uint64_t iWarmupEndTime;
+
+	uint64_t aLaneRequests[3];
+	uint64_t aLaneQueued[3];
+	uint64_t aLaneWaitTime[3];
+};
+
+extern struct fsstats g_tStats;
+
+#define FSSTATS_ADD(field, n) __atomic_add_fetch(&g_tStats.field, (n), __ATOMIC_RELAXED)
+#define FSSTATS_SUB(field, n) __atomic_sub_fetch(&g_tStats.field, (n), __ATOMIC_RELAXED)
+#define FSSTATS_SET(field, n) __atomic_store_n(&g_tStats.field, (n), __ATOMIC_RELAXED)
+#define FSSTATS_GET(field) __atomic_load_n(&g_tStats.field, __ATOMIC_RELAXED)
+
+uint64_t fsstats_now();
+size_t fsstats_format(char* sBuffer, size_t iSize);
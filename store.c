@@ -0,0 +1,509 @@
+#include "store.h"
+#include "os.h"
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <sys/xattr.h>
+#include <time.h>
+
+#define LOCK_STRIPES 1024
+#define IDENTITY_ATTRIBUTE "user.hexalinq-drive.path"
+#define IDENTITY_SIZE (PATH_MAX + 64)
+#define ACCESS_GRANULARITY 60
+#define MAX_FILE_SHARE 8
+
+// Copies of remote files are kept in a local directory, named after the hash
+// of the remote path (root + path) so that mounts of different roots sharing
+// the directory also share the copies. A file is stored either complete or in
+// blocks of FSSTORE_BLOCK_SIZE, which live in a directory of their own next to
+// the complete copy so that they can be removed together. A copy carries the remote modification time
+// as its own and has the size the remote file or block should have, so it is
+// only used while both still match the attributes the driver got from the
+// server. Copies are written to a temporary file and renamed into place, so a
+// reader never sees a partial one.
+
+static char* g_sDirectory = NULL;
+static char* g_sPrefix = NULL;
+static uint64_t g_iMaxSize = 0;
+static uint64_t g_iStored = 0;
+
+static uint64_t _HashString(uint64_t iHash, const char* sString) {
+	while(*sString) {
+		iHash ^= (uint8_t)*sString++;
+		iHash *= 0x100000001b3;
+	}
+
+	return iHash;
+}
+
+static uint64_t _Hash(const char* sPath) {
+	return _HashString(_HashString(0xcbf29ce484222325, g_sPrefix), sPath);
+}
+
+static int8_t _FilePath(char* sOutput, const char* sPath) {
+	int iLength = snprintf(sOutput, PATH_MAX, "%s/%016" PRIx64, g_sDirectory, _Hash(sPath));
+	return iLength < 0 || iLength >= PATH_MAX ? -1 : 0;
+}
+
+static int8_t _BlockDirectory(char* sOutput, const char* sPath) {
+	int iLength = snprintf(sOutput, PATH_MAX, "%s/%016" PRIx64 ".blocks", g_sDirectory, _Hash(sPath));
+	return iLength < 0 || iLength >= PATH_MAX ? -1 : 0;
+}
+
+static int8_t _BlockPath(char* sOutput, const char* sPath, uint64_t iBlock) {
+	int iLength = snprintf(sOutput, PATH_MAX, "%s/%016" PRIx64 ".blocks/%" PRIx64, g_sDirectory, _Hash(sPath), iBlock);
+	return iLength < 0 || iLength >= PATH_MAX ? -1 : 0;
+}
+
+// Removes a directory of blocks together with any temporary files in it.
+static void _RemoveBlocks(const char* sDirectory) {
+	DIR* hDirectory = opendir(sDirectory);
+	if(!hDirectory) return;
+
+	struct dirent* pEntry;
+	while((pEntry = readdir(hDirectory))) {
+		if(pEntry->d_name[0] != '.') unlinkat(dirfd(hDirectory), pEntry->d_name, 0);
+	}
+
+	closedir(hDirectory);
+	rmdir(sDirectory);
+}
+
+static uint64_t _BlockSize(const struct stat* pStat, uint64_t iBlock) {
+	uint64_t iStart = iBlock * FSSTORE_BLOCK_SIZE;
+	if(iStart >= (uint64_t)pStat->st_size) return 0;
+	uint64_t iRemaining = pStat->st_size - iStart;
+	return iRemaining < FSSTORE_BLOCK_SIZE ? iRemaining : FSSTORE_BLOCK_SIZE;
+}
+
+// File names are only a 64-bit hash, so every copy also carries the account
+// and full remote path it was made for in an extended attribute, which is
+// compared before the copy is used.
+static int _Identity(char* sOutput, const char* sPath) {
+	int iLength = snprintf(sOutput, IDENTITY_SIZE, "%s%s", g_sPrefix, sPath);
+	return iLength < 0 || iLength >= IDENTITY_SIZE ? -ENAMETOOLONG : iLength;
+}
+
+static int _OpenCopy(const char* sFile, const char* sPath, uint64_t iSize, const struct timespec* pVersion) {
+	char sIdentity[IDENTITY_SIZE], sStored[IDENTITY_SIZE];
+	int iIdentitySize = _Identity(sIdentity, sPath);
+	if(iIdentitySize < 0) return iIdentitySize;
+
+	int iFD = open(sFile, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if(iFD < 0) return -errno;
+
+	struct stat tLocal;
+	if(fstat(iFD, &tLocal) ||
+		(uint64_t)tLocal.st_size != iSize ||
+		tLocal.st_mtim.tv_sec != pVersion->tv_sec ||
+		tLocal.st_mtim.tv_nsec != pVersion->tv_nsec ||
+		fgetxattr(iFD, IDENTITY_ATTRIBUTE, sStored, sizeof(sStored)) != iIdentitySize ||
+		memcmp(sStored, sIdentity, iIdentitySize)) {
+		close(iFD);
+		return -ESTALE;
+	}
+
+	// Eviction goes by the access time. It is refreshed explicitly, since
+	// relatime would only update it once a day.
+	struct timespec tNow;
+	clock_gettime(CLOCK_REALTIME, &tNow);
+	if(tNow.tv_sec - tLocal.st_atim.tv_sec >= ACCESS_GRANULARITY) futimens(iFD, (struct timespec[2]){ { .tv_nsec = UTIME_NOW }, { .tv_nsec = UTIME_OMIT } });
+	return iFD;
+}
+
+// A copy is written to a temporary file next to its final name and only
+// renamed into place once it is complete.
+struct fsstore_writer {
+	int iFD;
+	uint64_t iSize;
+	struct timespec tVersion;
+	char sFile[PATH_MAX];
+	char sTemporary[PATH_MAX];
+};
+
+static struct fsstore_writer* _BeginCopy(const char* sFile, const char* sPath, uint64_t iSize, const struct timespec* pVersion) {
+	char sIdentity[IDENTITY_SIZE];
+	int iIdentitySize = _Identity(sIdentity, sPath);
+	if(iIdentitySize < 0) {
+		errno = -iIdentitySize;
+		return NULL;
+	}
+
+	if(iSize > g_iMaxSize / MAX_FILE_SHARE) {
+		errno = EFBIG;
+		return NULL;
+	}
+
+	struct fsstore_writer* pWriter = malloc(sizeof(struct fsstore_writer));
+	if(!pWriter) return NULL;
+
+	pWriter->iSize = iSize;
+	pWriter->tVersion = *pVersion;
+	strcpy(pWriter->sFile, sFile);
+	if(snprintf(pWriter->sTemporary, PATH_MAX, "%s.XXXXXX", sFile) >= PATH_MAX) {
+		free(pWriter);
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	if((pWriter->iFD = mkstemp(pWriter->sTemporary)) < 0) {
+		free(pWriter);
+		return NULL;
+	}
+
+	if(fsetxattr(pWriter->iFD, IDENTITY_ATTRIBUTE, sIdentity, iIdentitySize, 0)) {
+		int iError = errno;
+		fsstore_abort(pWriter);
+		errno = iError;
+		return NULL;
+	}
+
+	return pWriter;
+}
+
+static int _WriteCopy(const char* sFile, const char* sPath, const struct timespec* pVersion, const void* pData, uint64_t iSize) {
+	struct fsstore_writer* pWriter = _BeginCopy(sFile, sPath, iSize, pVersion);
+	if(!pWriter) return -errno;
+
+	int iStatus = fsstore_write(pWriter, pData, iSize, 0);
+	if(iStatus) {
+		fsstore_abort(pWriter);
+		return iStatus;
+	}
+
+	return fsstore_commit(pWriter);
+}
+
+// ===================================================
+// Eviction
+// ===================================================
+
+// The directory is kept below cache-dir-size by removing the least recently
+// used copies and blocks. Every mount scans it once after mounting and again
+// after it stored another sixteenth of the limit, so with several mounts
+// sharing the directory it can briefly exceed the limit by a sixteenth per
+// mount. The scan runs on a thread of its own, so the reads and the block
+// locks that store the copies never wait for it, and only one process scans
+// at a time.
+struct stored_file {
+	uint64_t iAccessed;
+	uint64_t iSize;
+	char sName[48];
+};
+
+static int _CompareAccess(const void* pA, const void* pB) {
+	const struct stored_file* pFileA = pA;
+	const struct stored_file* pFileB = pB;
+	return (pFileA->iAccessed > pFileB->iAccessed) - (pFileA->iAccessed < pFileB->iAccessed);
+}
+
+static int8_t _AddFile(struct stored_file** ppFiles, size_t* pCount, size_t* pCapacity, int iDirectory, const char* sPrefix, const char* sName) {
+	struct stat tStat;
+	if(fstatat(iDirectory, sName, &tStat, AT_SYMLINK_NOFOLLOW) || !S_ISREG(tStat.st_mode)) return 0;
+
+	if(*pCount == *pCapacity) {
+		size_t iCapacity = *pCapacity ? *pCapacity * 2 : 1024;
+		struct stored_file* pFiles = realloc(*ppFiles, iCapacity * sizeof(struct stored_file));
+		if(!pFiles) return -1;
+		*ppFiles = pFiles;
+		*pCapacity = iCapacity;
+	}
+
+	struct stored_file* pFile = &(*ppFiles)[*pCount];
+	if(snprintf(pFile->sName, sizeof(pFile->sName), "%s%s", sPrefix, sName) >= (int)sizeof(pFile->sName)) return 0;
+	pFile->iAccessed = (uint64_t)tStat.st_atim.tv_sec * 1000000000 + tStat.st_atim.tv_nsec;
+	pFile->iSize = (uint64_t)tStat.st_blocks * 512;
+	++*pCount;
+	return 0;
+}
+
+static pthread_mutex_t g_tEvictLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_tEvictCondition = PTHREAD_COND_INITIALIZER;
+static pthread_t g_hEvictor;
+static bool g_bEvictor = false;
+static bool g_bEvictPending = false;
+static bool g_bStopping = false;
+
+static void _Evict() {
+	char sLock[PATH_MAX];
+	int iLock = -1;
+	if(snprintf(sLock, PATH_MAX, "%s/.lock.evict", g_sDirectory) < PATH_MAX) iLock = open(sLock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(iLock < 0 || flock(iLock, LOCK_EX | LOCK_NB)) {
+		if(iLock >= 0) close(iLock);
+		return;
+	}
+
+	__atomic_store_n(&g_iStored, 0, __ATOMIC_RELAXED);
+
+	struct stored_file* pFiles = NULL;
+	size_t iCount = 0, iCapacity = 0;
+	uint64_t iTotal = 0;
+	DIR* hDirectory = opendir(g_sDirectory);
+	struct dirent* pEntry;
+	while(hDirectory && (pEntry = readdir(hDirectory))) {
+		if(pEntry->d_name[0] == '.') continue;
+		if(!strstr(pEntry->d_name, ".blocks")) {
+			if(_AddFile(&pFiles, &iCount, &iCapacity, dirfd(hDirectory), "", pEntry->d_name)) break;
+			continue;
+		}
+
+		int iBlocks = openat(dirfd(hDirectory), pEntry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+		DIR* hBlocks = iBlocks >= 0 ? fdopendir(iBlocks) : NULL;
+		if(!hBlocks) {
+			if(iBlocks >= 0) close(iBlocks);
+			continue;
+		}
+
+		char sPrefix[32];
+		snprintf(sPrefix, sizeof(sPrefix), "%.23s/", pEntry->d_name);
+		struct dirent* pBlock;
+		while((pBlock = readdir(hBlocks))) {
+			if(pBlock->d_name[0] != '.' && _AddFile(&pFiles, &iCount, &iCapacity, iBlocks, sPrefix, pBlock->d_name)) break;
+		}
+
+		closedir(hBlocks);
+	}
+
+	for(size_t i = 0; i < iCount; ++i) iTotal += pFiles[i].iSize;
+	if(iTotal > g_iMaxSize && hDirectory) {
+		qsort(pFiles, iCount, sizeof(struct stored_file), _CompareAccess);
+		uint64_t iTarget = g_iMaxSize - g_iMaxSize / 8;
+		for(size_t i = 0; i < iCount && iTotal > iTarget; ++i) {
+			if(unlinkat(dirfd(hDirectory), pFiles[i].sName, 0)) continue;
+			iTotal -= pFiles[i].iSize;
+
+			char* pSlash = strchr(pFiles[i].sName, '/');
+			if(!pSlash) continue;
+			*pSlash = '\0';
+			unlinkat(dirfd(hDirectory), pFiles[i].sName, AT_REMOVEDIR);
+		}
+	}
+
+	if(hDirectory) closedir(hDirectory);
+	free(pFiles);
+	close(iLock);
+}
+
+static void* _Evictor(void* pArgument) {
+	pthread_mutex_lock(&g_tEvictLock);
+	for(;;) {
+		while(!g_bEvictPending && !g_bStopping) pthread_cond_wait(&g_tEvictCondition, &g_tEvictLock);
+		if(g_bStopping) break;
+
+		g_bEvictPending = false;
+		pthread_mutex_unlock(&g_tEvictLock);
+		_Evict();
+		pthread_mutex_lock(&g_tEvictLock);
+	}
+
+	pthread_mutex_unlock(&g_tEvictLock);
+	return NULL;
+}
+
+static void _RequestEvict() {
+	pthread_mutex_lock(&g_tEvictLock);
+	g_bEvictPending = true;
+	pthread_cond_signal(&g_tEvictCondition);
+	pthread_mutex_unlock(&g_tEvictLock);
+}
+
+// ===================================================
+
+// Copies are keyed by a hash of the token, so mounts of different accounts
+// can share a directory without seeing each other's files.
+int8_t fsstore_configure(const char* sDirectory, const char* sAccount, const char* sRoot, uint64_t iMaxSize) {
+	if(!sDirectory) return 0;
+	g_iMaxSize = iMaxSize;
+	if(mkdir(sDirectory, 0700) && errno != EEXIST) return -1;
+
+	size_t iLength = sRoot ? strlen(sRoot) : 0;
+	while(iLength && sRoot[iLength - 1] == '/') --iLength;
+	if(!(g_sPrefix = malloc(16 + 1 + iLength + 1))) return -1;
+	sprintf(g_sPrefix, "%016" PRIx64 ":%.*s", _HashString(0xcbf29ce484222325, sAccount ? sAccount : ""), (int)iLength, sRoot ? sRoot : "");
+	// The daemon changes to / after forking, so a relative directory has to
+	// be resolved now.
+	g_sDirectory = realpath(sDirectory, NULL);
+	if(!g_sDirectory) return -1;
+
+	char sProbe[PATH_MAX];
+	if(snprintf(sProbe, PATH_MAX, "%s/.probe.XXXXXX", g_sDirectory) >= PATH_MAX) return -1;
+	int iFD = mkstemp(sProbe);
+	if(iFD < 0) return -1;
+
+	int iStatus = fsetxattr(iFD, IDENTITY_ATTRIBUTE, "", 0, 0);
+	if(iStatus) fprintf(stderr, "cache-dir: %s: Extended attributes are not supported: %s\n", g_sDirectory, strerror(errno));
+	close(iFD);
+	unlink(sProbe);
+	if(iStatus) return -1;
+
+	g_bEvictPending = true;
+	return 0;
+}
+
+// The evictor is started with the file system rather than on configure, as
+// the daemon forks in between.
+int8_t fsstore_start() {
+	if(!g_sDirectory) return 0;
+	if(pthread_create(&g_hEvictor, NULL, _Evictor, NULL)) return -1;
+	g_bEvictor = true;
+	return 0;
+}
+
+void fsstore_stop() {
+	pthread_mutex_lock(&g_tEvictLock);
+	g_bStopping = true;
+	pthread_cond_broadcast(&g_tEvictCondition);
+	pthread_mutex_unlock(&g_tEvictLock);
+
+	if(g_bEvictor) {
+		pthread_join(g_hEvictor, NULL);
+		g_bEvictor = false;
+	}
+}
+
+bool fsstore_enabled() {
+	return g_sDirectory != NULL;
+}
+
+bool fsstore_has_copy(const char* sPath) {
+	char sFile[PATH_MAX];
+	return g_sDirectory && !_FilePath(sFile, sPath) && !access(sFile, F_OK);
+}
+
+int fsstore_open(const char* sPath, const struct stat* pStat) {
+	if(!g_sDirectory || !S_ISREG(pStat->st_mode)) return -ENOENT;
+
+	char sFile[PATH_MAX];
+	if(_FilePath(sFile, sPath)) return -ENAMETOOLONG;
+	return _OpenCopy(sFile, sPath, pStat->st_size, &pStat->st_mtim);
+}
+
+int fsstore_put(const char* sPath, const struct stat* pStat, const void* pData, uint64_t iSize) {
+	if(!g_sDirectory) return 0;
+	if((uint64_t)pStat->st_size != iSize) return -EINVAL;
+
+	char sFile[PATH_MAX];
+	if(_FilePath(sFile, sPath)) return -ENAMETOOLONG;
+	return _WriteCopy(sFile, sPath, &pStat->st_mtim, pData, iSize);
+}
+
+struct fsstore_writer* fsstore_begin(const char* sPath, const struct stat* pStat) {
+	char sFile[PATH_MAX];
+	if(!g_sDirectory || !S_ISREG(pStat->st_mode)) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	if(_FilePath(sFile, sPath)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	return _BeginCopy(sFile, sPath, pStat->st_size, &pStat->st_mtim);
+}
+
+int fsstore_write(struct fsstore_writer* pWriter, const void* pData, uint64_t iSize, off_t iOffset) {
+	const char* pCursor = pData;
+	while(iSize) {
+		ssize_t iWritten = pwrite(pWriter->iFD, pCursor, iSize, iOffset);
+		if(iWritten < 0 && errno == EINTR) continue;
+		if(iWritten <= 0) return iWritten ? -errno : -EIO;
+
+		pCursor += iWritten;
+		iOffset += iWritten;
+		iSize -= iWritten;
+	}
+
+	return 0;
+}
+
+int fsstore_commit(struct fsstore_writer* pWriter) {
+	// Only the modification time identifies the version, the access time is
+	// left as it is for eviction.
+	int iError = 0;
+	struct stat tLocal;
+	struct timespec aTimes[2] = { { .tv_nsec = UTIME_OMIT }, pWriter->tVersion };
+	if(fstat(pWriter->iFD, &tLocal)) iError = -errno;
+	else if((uint64_t)tLocal.st_size != pWriter->iSize) iError = -EIO;
+	else if(futimens(pWriter->iFD, aTimes)) iError = -errno;
+
+	if(close(pWriter->iFD) && !iError) iError = -errno;
+	if(!iError && rename(pWriter->sTemporary, pWriter->sFile)) iError = -errno;
+
+	if(iError) unlink(pWriter->sTemporary);
+	else if(__atomic_add_fetch(&g_iStored, pWriter->iSize, __ATOMIC_RELAXED) >= g_iMaxSize / 16) _RequestEvict();
+	free(pWriter);
+	return iError;
+}
+
+void fsstore_abort(struct fsstore_writer* pWriter) {
+	close(pWriter->iFD);
+	unlink(pWriter->sTemporary);
+	free(pWriter);
+}
+
+void fsstore_remove(const char* sPath) {
+	if(!g_sDirectory) return;
+
+	char sFile[PATH_MAX];
+	if(!_FilePath(sFile, sPath)) unlink(sFile);
+	if(!_BlockDirectory(sFile, sPath)) _RemoveBlocks(sFile);
+}
+
+int fsstore_open_block(const char* sPath, const struct stat* pStat, uint64_t iBlock) {
+	if(!g_sDirectory) return -ENOENT;
+
+	char sFile[PATH_MAX];
+	if(_BlockPath(sFile, sPath, iBlock)) return -ENAMETOOLONG;
+	return _OpenCopy(sFile, sPath, _BlockSize(pStat, iBlock), &pStat->st_mtim);
+}
+
+int fsstore_read_block(const char* sPath, const struct stat* pStat, uint64_t iBlock, void* pBuffer, size_t iSize, off_t iOffset) {
+	int iFD = fsstore_open_block(sPath, pStat, iBlock);
+	if(iFD < 0) return iFD;
+
+	ssize_t iRead = pread(iFD, pBuffer, iSize, iOffset);
+	int iStatus = iRead < 0 ? -errno : iRead;
+	close(iFD);
+	return iStatus;
+}
+
+int fsstore_put_block(const char* sPath, const struct stat* pStat, uint64_t iBlock, const void* pData, uint64_t iSize) {
+	if(!g_sDirectory) return 0;
+	if(iSize != _BlockSize(pStat, iBlock)) return -EINVAL;
+
+	char sFile[PATH_MAX];
+	if(_BlockDirectory(sFile, sPath)) return -ENAMETOOLONG;
+	if(mkdir(sFile, 0700) && errno != EEXIST) return -errno;
+	if(_BlockPath(sFile, sPath, iBlock)) return -ENAMETOOLONG;
+	return _WriteCopy(sFile, sPath, &pStat->st_mtim, pData, iSize);
+}
+
+// Fetching a block is serialized between threads and processes with flock on
+// one of a fixed set of lock files, so the directory does not fill up with
+// them. Each call opens its own descriptor, which is what makes flock exclude
+// threads of the same process as well.
+int fsstore_lock(const char* sPath, uint64_t iBlock) {
+	if(!g_sDirectory) return -ENOENT;
+
+	char sFile[PATH_MAX];
+	uint64_t iStripe = (_Hash(sPath) ^ (iBlock * 0x9e3779b97f4a7c15)) % LOCK_STRIPES;
+	if(snprintf(sFile, PATH_MAX, "%s/.lock.%03" PRIx64, g_sDirectory, iStripe) >= PATH_MAX) return -ENAMETOOLONG;
+
+	int iFD = open(sFile, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(iFD < 0) return -errno;
+
+	while(flock(iFD, LOCK_EX)) {
+		if(errno == EINTR) continue;
+		int iError = -errno;
+		close(iFD);
+		return iError;
+	}
+
+	return iFD;
+}
+
+void fsstore_unlock(int iLock) {
+	if(iLock >= 0) close(iLock);
+}
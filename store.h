@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FSSTORE_BLOCK_SIZE (256 * 1024)
+
+struct fsstore_writer;
+
+int8_t fsstore_configure(const char* sDirectory, const char* sAccount, const char* sRoot, uint64_t iMaxSize);
+int8_t fsstore_start();
+void fsstore_stop();
+bool fsstore_enabled();
+bool fsstore_has_copy(const char* sPath);
+int fsstore_open(const char* sPath, const struct stat* pStat);
+int fsstore_put(const char* sPath, const struct stat* pStat, const void* pData, uint64_t iSize);
+struct fsstore_writer* fsstore_begin(const char* sPath, const struct stat* pStat);
+int fsstore_write(struct fsstore_writer* pWriter, const void* pData, uint64_t iSize, off_t iOffset);
+int fsstore_commit(struct fsstore_writer* pWriter);
+void fsstore_abort(struct fsstore_writer* pWriter);
+void fsstore_remove(const char* sPath);
+int fsstore_open_block(const char* sPath, const struct stat* pStat, uint64_t iBlock);
+int fsstore_read_block(const char* sPath, const struct stat* pStat, uint64_t iBlock, void* pBuffer, size_t iSize, off_t iOffset);
+int fsstore_put_block(const char* sPath, const struct stat* pStat, uint64_t iBlock, const void* pData, uint64_t iSize);
+int fsstore_lock(const char* sPath, uint64_t iBlock);
+void fsstore_unlock(int iLock);
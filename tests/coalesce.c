@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include "../driver.h"
+#include "../rpc.h"
+#include "../cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+// A getattr that starts while an earlier getattr of the same path is still in
+// flight, but after the path was changed, must not receive the earlier reply,
+// and the earlier reply must not end up in the cache.
+// Usage: coalesce [mock-fsapi]
+
+#define LATENCY_US 400000
+
+static char g_sDirectory[] = "/tmp/hexalinq-drive-test.XXXXXX";
+static char g_sFile[sizeof(g_sDirectory) + 8];
+
+static off_t _Getattr() {
+	struct stat tStat;
+	int iStatus = fsdriver_operations.getattr("/file", &tStat, NULL);
+	if(iStatus) {
+		fprintf(stderr, "coalesce: getattr: %s\n", strerror(-iStatus));
+		return -1;
+	}
+
+	return tStat.st_size;
+}
+
+static void* _EarlyGetattr(void* pArgument) {
+	*(off_t*)pArgument = _Getattr();
+	return NULL;
+}
+
+static int8_t _Resize(off_t iSize) {
+	if(truncate(g_sFile, iSize)) return -1;
+	// What the driver does once the server has applied a write.
+	fscache_invalidate("/file");
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	const char* sServer = argc > 1 ? argv[1] : "./tools/mock-fsapi";
+	if(!mkdtemp(g_sDirectory)) return 1;
+	snprintf(g_sFile, sizeof(g_sFile), "%s/file", g_sDirectory);
+	FILE* hFile = fopen(g_sFile, "w");
+	if(!hFile || fputc('x', hFile) == EOF || fclose(hFile)) return 1;
+
+	char sPort[8], sLatency[16], sEndpoint[64];
+	snprintf(sPort, sizeof(sPort), "%d", 20000 + getpid() % 20000);
+	snprintf(sLatency, sizeof(sLatency), "%d", LATENCY_US);
+	snprintf(sEndpoint, sizeof(sEndpoint), "http://127.0.0.1:%s/fsapi", sPort);
+
+	pid_t iServer = fork();
+	if(iServer < 0) return 1;
+	if(!iServer) {
+		execl(sServer, sServer, "-p", sPort, "-l", sLatency, g_sDirectory, NULL);
+		_exit(127);
+	}
+
+	int iStatus = 1;
+	if(fsrpc_init() || fsrpc_set_endpoint(sEndpoint) || fsrpc_set_token("test")) goto done;
+	if(fscache_init(60, 0)) goto done;
+
+	for(int i = 0; fsrpc_connect(); ++i) {
+		if(i == 50) {
+			fprintf(stderr, "coalesce: %s did not start\n", sServer);
+			goto done;
+		}
+
+		usleep(100 * 1000);
+	}
+
+	// The early getattr is answered with size 1 after the latency, the file
+	// grows to 2 bytes while it is in flight.
+	off_t iEarly = -1;
+	pthread_t hThread;
+	if(pthread_create(&hThread, NULL, _EarlyGetattr, &iEarly)) goto done;
+	usleep(LATENCY_US / 4);
+	if(_Resize(2)) goto done;
+
+	off_t iLate = _Getattr();
+	pthread_join(hThread, NULL);
+	off_t iCached = _Getattr();
+
+	if(iEarly != 1) fprintf(stderr, "coalesce: the early getattr saw %ld bytes instead of 1\n", iEarly);
+	else if(iLate != 2) fprintf(stderr, "coalesce: a getattr after the write saw %ld bytes instead of 2\n", iLate);
+	else if(iCached != 2) fprintf(stderr, "coalesce: the cache holds %ld bytes instead of 2\n", iCached);
+	else {
+		printf("coalesce: ok\n");
+		iStatus = 0;
+	}
+
+	done:
+	kill(iServer, SIGTERM);
+	waitpid(iServer, NULL, 0);
+	unlink(g_sFile);
+	rmdir(g_sDirectory);
+	return iStatus;
+}
@@ -0,0 +1,64 @@
+#include "../sched.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+
+// Fills the data and background lanes with more requests than there are
+// slots and checks that a metadata request is still admitted right away.
+// Usage: sched
+
+#define MAX_ACTIVE 8
+#define BULK_THREADS (2 * MAX_ACTIVE)
+
+static uint32_t g_iGranted = 0;
+static bool g_bRelease = false;
+
+static void* _Hold(void* pArgument) {
+	enum fssched_lane iLane = (uintptr_t)pArgument;
+	fssched_acquire(iLane, 1);
+	__atomic_add_fetch(&g_iGranted, 1, __ATOMIC_ACQ_REL);
+	while(!__atomic_load_n(&g_bRelease, __ATOMIC_ACQUIRE)) usleep(1000);
+	fssched_release(iLane);
+	return NULL;
+}
+
+static void _Timeout(int iSignal) {
+	fprintf(stderr, "sched: a metadata request waited behind bulk requests\n");
+	_exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	signal(SIGALRM, _Timeout);
+	fssched_configure(MAX_ACTIVE);
+
+	pthread_t aThreads[2 * BULK_THREADS];
+	for(uint32_t i = 0; i < BULK_THREADS; ++i) {
+		if(pthread_create(&aThreads[2 * i], NULL, _Hold, (void*)(uintptr_t)FSSCHED_BACKGROUND)) return 1;
+		if(pthread_create(&aThreads[2 * i + 1], NULL, _Hold, (void*)(uintptr_t)FSSCHED_DATA)) return 1;
+	}
+
+	usleep(200 * 1000);
+	uint32_t iGranted = __atomic_load_n(&g_iGranted, __ATOMIC_ACQUIRE);
+	if(!iGranted || iGranted >= MAX_ACTIVE) {
+		fprintf(stderr, "sched: %u of %u slots went to bulk requests\n", iGranted, MAX_ACTIVE);
+		return 1;
+	}
+
+	alarm(5);
+	fssched_acquire(FSSCHED_METADATA, 1);
+	alarm(0);
+	fssched_release(FSSCHED_METADATA);
+
+	__atomic_store_n(&g_bRelease, true, __ATOMIC_RELEASE);
+	for(uint32_t i = 0; i < 2 * BULK_THREADS; ++i) pthread_join(aThreads[i], NULL);
+	if(g_iGranted != 2 * BULK_THREADS) {
+		fprintf(stderr, "sched: only %u of %u bulk requests were admitted\n", g_iGranted, 2 * BULK_THREADS);
+		return 1;
+	}
+
+	printf("sched: ok\n");
+	return 0;
+}
@@ -0,0 +1,42 @@
+#include "../wire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Entry names that are empty, contain a '/' or a NUL must fail the listing
+// with -EIO in both formats, after the valid entry before them was returned.
+// Usage: wire
+
+int main(int argc, char* argv[]) {
+	static const struct { const char* sName; uint8_t iSize; } aNames[] = {
+		{ "", 0 },
+		{ "a/b", 3 },
+		{ "a\0b", 3 },
+		{ "/", 1 },
+	};
+
+	char aBuffer[512];
+	for(uint8_t iVersion = 1; iVersion <= 2; ++iVersion) {
+		for(size_t i = 0; i < sizeof(aNames) / sizeof(aNames[0]); ++i) {
+			struct fswire_entry aEntries[2] = {
+				{ .sName = "valid", .iNameSize = 5 },
+				{ .sName = aNames[i].sName, .iNameSize = aNames[i].iSize },
+			};
+
+			size_t iSize = fswire_encode_readdir(iVersion, FSWIRE_ALL, aEntries, 2, aBuffer, sizeof(aBuffer));
+			struct fswire_decoder tDecoder;
+			struct fswire_entry tEntry;
+			if(!iSize || fswire_readdir_begin(&tDecoder, iVersion, aBuffer, iSize)
+				|| fswire_readdir_next(&tDecoder, &tEntry) != 1
+				|| tEntry.iNameSize != 5 || memcmp(tEntry.sName, "valid", 5)
+				|| fswire_readdir_next(&tDecoder, &tEntry) != -EIO) {
+				fprintf(stderr, "wire: binary-le-%u: malformed name %zu was accepted\n", iVersion, i);
+				return 1;
+			}
+		}
+	}
+
+	printf("wire: ok\n");
+	return 0;
+}
@@ -0,0 +1,452 @@
+#define _GNU_SOURCE
+#include "../wire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// A local stand-in for the fsapi server that serves a directory. It speaks the
+// subset of the protocol the driver uses, binary-le-1 and binary-le-2, over
+// plain HTTP/1.1 with one thread per connection. Build the driver against it
+// with `make SCHEME=http ENDPOINT=127.0.0.1:<port>`.
+//
+// Usage: mock-fsapi [-p port] [-l latency_us] <directory>
+
+#define MAX_HEADER_SIZE (64 * 1024)
+#define MAX_BODY_SIZE (64 * 1024 * 1024)
+#define MAX_READ_SIZE (64 * 1024 * 1024)
+
+struct request {
+	char sMethod[32];
+	char sPath[PATH_MAX];
+	char sFormat[32];
+	uint64_t iOffset;
+	uint64_t iSize;
+	uint32_t xFields;
+	uint32_t xAccess;
+	uint32_t xMode;
+	bool bTrunc;
+	bool bCreate;
+	bool bExcl;
+	bool bClose;
+	bool bContinue;
+	uint64_t iContentLength;
+};
+
+struct response {
+	int iStatusCode;
+	uint8_t* pBody;
+	size_t iSize;
+	size_t iCapacity;
+};
+
+static const char* g_sRoot = NULL;
+static uint32_t g_iLatency = 0;
+
+static uint8_t _ErrorCode(int iError) {
+	switch(iError) {
+		case 0: return 0;
+		case ENOENT: return 1;
+		case EACCES: case EPERM: return 2;
+		case ENOTDIR: return 3;
+		case ENOTSUP: return 5;
+		case EISDIR: return 6;
+		case EEXIST: return 7;
+		case EDQUOT: return 8;
+		case ENOTEMPTY: return 9;
+		case EROFS: return 10;
+		case ENOSPC: return 11;
+		case EAGAIN: return 12;
+		default: return 4;
+	}
+}
+
+// ===================================================
+// Responses
+// ===================================================
+
+static bool _Reserve(struct response* pResponse, size_t iSize) {
+	if(pResponse->iSize + iSize <= pResponse->iCapacity) return true;
+
+	size_t iCapacity = pResponse->iCapacity ? pResponse->iCapacity : 4096;
+	while(iCapacity < pResponse->iSize + iSize) iCapacity *= 2;
+	uint8_t* pBody = realloc(pResponse->pBody, iCapacity);
+	if(!pBody) return false;
+
+	pResponse->pBody = pBody;
+	pResponse->iCapacity = iCapacity;
+	return true;
+}
+
+static void _Append(struct response* pResponse, const void* pData, size_t iSize) {
+	if(!_Reserve(pResponse, iSize)) {
+		pResponse->iStatusCode = 500;
+		return;
+	}
+
+	memcpy(pResponse->pBody + pResponse->iSize, pData, iSize);
+	pResponse->iSize += iSize;
+}
+
+static void _AppendHeader(struct response* pResponse, int iError) {
+	uint8_t aHeader[8] = { _ErrorCode(iError) };
+	_Append(pResponse, aHeader, sizeof(aHeader));
+}
+
+static void _ConvertStat(const struct stat* pStat, struct fsrpc_stat* pOutput) {
+	memset(pOutput, 0, sizeof(struct fsrpc_stat));
+	pOutput->iSize = pStat->st_size;
+	pOutput->tAccessTime = (struct fsrpc_timespec){ pStat->st_atim.tv_sec, pStat->st_atim.tv_nsec };
+	pOutput->tModificationTime = (struct fsrpc_timespec){ pStat->st_mtim.tv_sec, pStat->st_mtim.tv_nsec };
+	pOutput->tMetadataChangeTime = (struct fsrpc_timespec){ pStat->st_ctim.tv_sec, pStat->st_ctim.tv_nsec };
+	pOutput->tCreateTime = pOutput->tMetadataChangeTime;
+	pOutput->iMappedUser = pStat->st_uid;
+	pOutput->iMappedGroup = pStat->st_gid;
+	pOutput->xPermissionBits = pStat->st_mode & 07777;
+	pOutput->iType = S_ISDIR(pStat->st_mode) ? 0 : S_ISREG(pStat->st_mode) ? 1 : 2;
+}
+
+// ===================================================
+// Methods
+// ===================================================
+
+static void _Getattr(const struct request* pRequest, const char* sPath, struct response* pResponse) {
+	struct stat tStat;
+	if(lstat(sPath, &tStat)) {
+		_AppendHeader(pResponse, errno);
+		return;
+	}
+
+	struct fsrpc_stat tOutput;
+	_ConvertStat(&tStat, &tOutput);
+	_AppendHeader(pResponse, 0);
+	_Append(pResponse, &tOutput, sizeof(tOutput));
+}
+
+static void _Readdir(const struct request* pRequest, const char* sPath, struct response* pResponse) {
+	uint8_t iVersion = strcmp(pRequest->sFormat, "binary-le-2") == 0 ? 2 : 1;
+	DIR* pDirectory = opendir(sPath);
+	if(!pDirectory) {
+		if(iVersion == 1) pResponse->iStatusCode = 404;
+		else _Append(pResponse, (uint8_t[]){ _ErrorCode(errno) }, 1);
+		return;
+	}
+
+	struct fswire_entry* aEntries = NULL;
+	uint64_t iCount = 0;
+	uint64_t iCapacity = 0;
+	struct dirent* pEntry;
+	while((pEntry = readdir(pDirectory))) {
+		if(strcmp(pEntry->d_name, ".") == 0 || strcmp(pEntry->d_name, "..") == 0) continue;
+
+		struct stat tStat;
+		if(fstatat(dirfd(pDirectory), pEntry->d_name, &tStat, AT_SYMLINK_NOFOLLOW)) continue;
+
+		if(iCount == iCapacity) {
+			iCapacity = iCapacity ? iCapacity * 2 : 64;
+			struct fswire_entry* aResized = realloc(aEntries, iCapacity * sizeof(struct fswire_entry));
+			if(!aResized) break;
+			aEntries = aResized;
+		}
+
+		struct fswire_entry* pOutput = &aEntries[iCount];
+		_ConvertStat(&tStat, &pOutput->tStat);
+		pOutput->iNameSize = strnlen(pEntry->d_name, FSWIRE_MAX_NAME);
+		pOutput->sName = strndup(pEntry->d_name, FSWIRE_MAX_NAME);
+		if(pOutput->sName) ++iCount;
+	}
+
+	closedir(pDirectory);
+
+	size_t iSize = iCount * (sizeof(struct fsrpc_dirent) + FSWIRE_MAX_NAME + 8) + 64;
+	if(_Reserve(pResponse, iSize)) {
+		pResponse->iSize = fswire_encode_readdir(iVersion, pRequest->xFields, aEntries, iCount, pResponse->pBody, iSize);
+		if(!pResponse->iSize) pResponse->iStatusCode = 500;
+	} else {
+		pResponse->iStatusCode = 500;
+	}
+
+	for(uint64_t i = 0; i < iCount; ++i) free((void*)aEntries[i].sName);
+	free(aEntries);
+}
+
+static void _Read(const struct request* pRequest, const char* sPath, struct response* pResponse) {
+	if(pRequest->iSize > MAX_READ_SIZE) {
+		pResponse->iStatusCode = 400;
+		return;
+	}
+
+	int iFD = open(sPath, O_RDONLY | O_CLOEXEC);
+	if(iFD < 0) {
+		_AppendHeader(pResponse, errno);
+		return;
+	}
+
+	_AppendHeader(pResponse, 0);
+	if(_Reserve(pResponse, pRequest->iSize)) {
+		ssize_t iRead = pread(iFD, pResponse->pBody + pResponse->iSize, pRequest->iSize, pRequest->iOffset);
+		if(iRead < 0) pResponse->pBody[0] = _ErrorCode(errno);
+		else pResponse->iSize += iRead;
+	} else {
+		pResponse->iStatusCode = 500;
+	}
+
+	close(iFD);
+}
+
+static void _Open(const struct request* pRequest, const char* sPath, struct response* pResponse) {
+	int xFlags = (pRequest->xAccess & O_ACCMODE) | O_CLOEXEC;
+	if(pRequest->bTrunc) xFlags |= O_TRUNC;
+	if(pRequest->bCreate) xFlags |= O_CREAT;
+	if(pRequest->bExcl) xFlags |= O_EXCL;
+
+	int iFD = open(sPath, xFlags, pRequest->xMode & 07777);
+	_AppendHeader(pResponse, iFD < 0 ? errno : 0);
+	if(iFD >= 0) close(iFD);
+}
+
+static void _Write(const struct request* pRequest, const char* sPath, const void* pBody, struct response* pResponse) {
+	int iFD = open(sPath, O_WRONLY | O_CLOEXEC);
+	if(iFD < 0) {
+		_AppendHeader(pResponse, errno);
+		return;
+	}
+
+	ssize_t iWritten = pwrite(iFD, pBody, pRequest->iContentLength, pRequest->iOffset);
+	_AppendHeader(pResponse, iWritten < 0 ? errno : (uint64_t)iWritten != pRequest->iContentLength ? EIO : 0);
+	close(iFD);
+}
+
+static void _Statvfs(struct response* pResponse) {
+	struct statvfs tStat;
+	if(statvfs(g_sRoot, &tStat)) {
+		pResponse->iStatusCode = 500;
+		return;
+	}
+
+	struct fsrpc_statvfs tOutput = {
+		.iTotalSpace = (uint64_t)tStat.f_blocks * tStat.f_frsize,
+		.iFreeSpace = (uint64_t)tStat.f_bavail * tStat.f_frsize,
+		.iTotalInodes = tStat.f_files,
+		.iFreeInodes = tStat.f_ffree,
+	};
+
+	_Append(pResponse, &tOutput, sizeof(tOutput));
+}
+
+static void _Dispatch(const struct request* pRequest, const void* pBody, struct response* pResponse) {
+	const char* sMethod = pRequest->sMethod;
+	if(strcmp(sMethod, "INIT") == 0) return _AppendHeader(pResponse, 0);
+	if(strcmp(sMethod, "DESTROY") == 0) return;
+	if(strcmp(sMethod, "STATVFS") == 0) return _Statvfs(pResponse);
+
+	// Paths are relative to the served directory and may not leave it.
+	const char* sRelative = pRequest->sPath;
+	if(sRelative[0] != '/' || strstr(sRelative, "/../") || (strlen(sRelative) >= 3 && strcmp(sRelative + strlen(sRelative) - 3, "/..") == 0)) {
+		pResponse->iStatusCode = 400;
+		return;
+	}
+
+	char sPath[PATH_MAX];
+	if(snprintf(sPath, sizeof(sPath), "%s%s", g_sRoot, sRelative) >= (int)sizeof(sPath)) {
+		pResponse->iStatusCode = 414;
+		return;
+	}
+
+	if(strcmp(sMethod, "GETATTR") == 0) _Getattr(pRequest, sPath, pResponse);
+	else if(strcmp(sMethod, "READDIR") == 0) _Readdir(pRequest, sPath, pResponse);
+	else if(strcmp(sMethod, "READ") == 0) _Read(pRequest, sPath, pResponse);
+	else if(strcmp(sMethod, "OPEN") == 0) _Open(pRequest, sPath, pResponse);
+	else if(strcmp(sMethod, "WRITE") == 0) _Write(pRequest, sPath, pBody, pResponse);
+	else if(strcmp(sMethod, "TRUNCATE") == 0) _AppendHeader(pResponse, truncate(sPath, pRequest->iSize) ? errno : 0);
+	else if(strcmp(sMethod, "UNLINK") == 0) _AppendHeader(pResponse, unlink(sPath) ? errno : 0);
+	else if(strcmp(sMethod, "RMDIR") == 0) _AppendHeader(pResponse, rmdir(sPath) ? errno : 0);
+	else if(strcmp(sMethod, "MKDIR") == 0) _AppendHeader(pResponse, mkdir(sPath, pRequest->xMode & 07777) ? errno : 0);
+	else pResponse->iStatusCode = 501;
+}
+
+// ===================================================
+// HTTP
+// ===================================================
+
+static void _Unescape(char* sOutput, size_t iCapacity, const char* sValue) {
+	size_t iSize = 0;
+	while(*sValue && iSize + 1 < iCapacity) {
+		unsigned int iByte;
+		if(sValue[0] == '%' && sscanf(sValue + 1, "%2x", &iByte) == 1) {
+			sOutput[iSize++] = iByte;
+			sValue += 3;
+		} else {
+			sOutput[iSize++] = *sValue++;
+		}
+	}
+
+	sOutput[iSize] = '\0';
+}
+
+static int _ParseRequest(char* sHeader, struct request* pRequest) {
+	memset(pRequest, 0, sizeof(struct request));
+	pRequest->xFields = FSWIRE_ALL;
+
+	char* sSave = NULL;
+	char* sLine = strtok_r(sHeader, "\r\n", &sSave);
+	if(!sLine || sscanf(sLine, "%31s", pRequest->sMethod) != 1) return -1;
+	if(strstr(sLine, "HTTP/1.0")) pRequest->bClose = true;
+
+	while((sLine = strtok_r(NULL, "\r\n", &sSave))) {
+		char* sValue = strchr(sLine, ':');
+		if(!sValue) return -1;
+		*sValue++ = '\0';
+		while(*sValue == ' ') ++sValue;
+
+		char sDecoded[PATH_MAX];
+		_Unescape(sDecoded, sizeof(sDecoded), sValue);
+
+		if(strcasecmp(sLine, "X-Path") == 0) _Unescape(pRequest->sPath, sizeof(pRequest->sPath), sValue);
+		else if(strcasecmp(sLine, "X-Format") == 0) _Unescape(pRequest->sFormat, sizeof(pRequest->sFormat), sValue);
+		else if(strcasecmp(sLine, "X-Offset") == 0) pRequest->iOffset = strtoull(sDecoded, NULL, 10);
+		else if(strcasecmp(sLine, "X-Size") == 0) pRequest->iSize = strtoull(sDecoded, NULL, 10);
+		else if(strcasecmp(sLine, "X-Fields") == 0) pRequest->xFields = strtoul(sDecoded, NULL, 10);
+		else if(strcasecmp(sLine, "X-Access") == 0) pRequest->xAccess = strtoul(sDecoded, NULL, 10);
+		else if(strcasecmp(sLine, "X-Mode") == 0) pRequest->xMode = strtoul(sDecoded, NULL, 10);
+		else if(strcasecmp(sLine, "X-Trunc") == 0) pRequest->bTrunc = atoi(sDecoded);
+		else if(strcasecmp(sLine, "X-Create") == 0) pRequest->bCreate = atoi(sDecoded);
+		else if(strcasecmp(sLine, "X-Excl") == 0) pRequest->bExcl = atoi(sDecoded);
+		else if(strcasecmp(sLine, "Content-Length") == 0) pRequest->iContentLength = strtoull(sDecoded, NULL, 10);
+		else if(strcasecmp(sLine, "Connection") == 0) pRequest->bClose = strcasecmp(sDecoded, "close") == 0;
+		else if(strcasecmp(sLine, "Expect") == 0) pRequest->bContinue = strcasecmp(sDecoded, "100-continue") == 0;
+	}
+
+	return 0;
+}
+
+static bool _WriteAll(int iSocket, const void* pData, size_t iSize) {
+	const char* pCursor = pData;
+	while(iSize) {
+		ssize_t iWritten = send(iSocket, pCursor, iSize, MSG_NOSIGNAL);
+		if(iWritten < 0 && errno == EINTR) continue;
+		if(iWritten <= 0) return false;
+		pCursor += iWritten;
+		iSize -= iWritten;
+	}
+
+	return true;
+}
+
+static void* _Serve(void* pArgument) {
+	int iSocket = (int)(intptr_t)pArgument;
+	char* pBuffer = malloc(MAX_HEADER_SIZE);
+	size_t iBuffered = 0;
+	bool bOpen = pBuffer != NULL;
+
+	while(bOpen) {
+		char* pHeaderEnd;
+		while(!(pHeaderEnd = memmem(pBuffer, iBuffered, "\r\n\r\n", 4))) {
+			if(iBuffered == MAX_HEADER_SIZE) goto done;
+			ssize_t iRead = recv(iSocket, pBuffer + iBuffered, MAX_HEADER_SIZE - iBuffered, 0);
+			if(iRead < 0 && errno == EINTR) continue;
+			if(iRead <= 0) goto done;
+			iBuffered += iRead;
+		}
+
+		size_t iHeaderSize = pHeaderEnd + 4 - pBuffer;
+		pHeaderEnd[2] = '\0';
+
+		struct request tRequest;
+		if(_ParseRequest(pBuffer, &tRequest) || tRequest.iContentLength > MAX_BODY_SIZE) break;
+		if(tRequest.bContinue && !_WriteAll(iSocket, "HTTP/1.1 100 Continue\r\n\r\n", 25)) break;
+
+		// The body may have arrived together with the header.
+		uint8_t* pBody = malloc(tRequest.iContentLength ? tRequest.iContentLength : 1);
+		if(!pBody) break;
+
+		size_t iBodySize = iBuffered - iHeaderSize < tRequest.iContentLength ? iBuffered - iHeaderSize : tRequest.iContentLength;
+		memcpy(pBody, pBuffer + iHeaderSize, iBodySize);
+		memmove(pBuffer, pBuffer + iHeaderSize + iBodySize, iBuffered - iHeaderSize - iBodySize);
+		iBuffered -= iHeaderSize + iBodySize;
+
+		while(iBodySize < tRequest.iContentLength) {
+			ssize_t iRead = recv(iSocket, pBody + iBodySize, tRequest.iContentLength - iBodySize, 0);
+			if(iRead < 0 && errno == EINTR) continue;
+			if(iRead <= 0) {
+				free(pBody);
+				goto done;
+			}
+
+			iBodySize += iRead;
+		}
+
+		struct response tResponse = { .iStatusCode = 200 };
+		_Dispatch(&tRequest, pBody, &tResponse);
+		free(pBody);
+		if(g_iLatency) usleep(g_iLatency);
+
+		size_t iBodyLength = tResponse.iStatusCode == 200 ? tResponse.iSize : 0;
+		char sHeader[128];
+		int iHeaderLength = snprintf(sHeader, sizeof(sHeader), "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n\r\n", tResponse.iStatusCode, tResponse.iStatusCode == 200 ? "OK" : "Error", iBodyLength);
+		bOpen = _WriteAll(iSocket, sHeader, iHeaderLength) && _WriteAll(iSocket, tResponse.pBody, iBodyLength) && !tRequest.bClose;
+		free(tResponse.pBody);
+	}
+
+	done:
+	free(pBuffer);
+	close(iSocket);
+	return NULL;
+}
+
+int main(int argc, char* argv[]) {
+	uint16_t iPort = 8080;
+	int iOption;
+	while((iOption = getopt(argc, argv, "p:l:")) != -1) {
+		switch(iOption) {
+			case 'p': iPort = atoi(optarg); break;
+			case 'l': g_iLatency = strtoul(optarg, NULL, 10); break;
+			default: goto usage;
+		}
+	}
+
+	if(optind + 1 != argc) goto usage;
+	g_sRoot = argv[optind];
+
+	int iListener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int bReuse = 1;
+	setsockopt(iListener, SOL_SOCKET, SO_REUSEADDR, &bReuse, sizeof(bReuse));
+
+	struct sockaddr_in tAddress = { .sin_family = AF_INET, .sin_port = htons(iPort), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	if(iListener < 0 || bind(iListener, (struct sockaddr*)&tAddress, sizeof(tAddress)) || listen(iListener, 128)) {
+		perror("listen");
+		return 1;
+	}
+
+	fprintf(stderr, "Serving %s on http://127.0.0.1:%u/fsapi\n", g_sRoot, iPort);
+	for(;;) {
+		int iSocket = accept4(iListener, NULL, NULL, SOCK_CLOEXEC);
+		if(iSocket < 0) {
+			if(errno != EINTR) perror("accept");
+			continue;
+		}
+
+		int bNoDelay = 1;
+		setsockopt(iSocket, IPPROTO_TCP, TCP_NODELAY, &bNoDelay, sizeof(bNoDelay));
+
+		pthread_t hThread;
+		if(pthread_create(&hThread, NULL, _Serve, (void*)(intptr_t)iSocket)) close(iSocket);
+		else pthread_detach(hThread);
+	}
+
+	usage:
+	fprintf(stderr, "Usage: %s [-p port] [-l latency_us] <directory>\n", argv[0]);
+	return 1;
+}
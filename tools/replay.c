@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include "../record.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+// Replays a recording made with -o record= against a mount point and reports
+// the latency distribution of every kind of call next to the recorded one.
+// Calls are issued at their recorded start times divided by the speed factor,
+// or back to back with -s 0, by a pool of workers. Calls that change the file
+// system are skipped unless -w is given.
+//
+// Usage: replay [-s speed] [-j jobs] [-w] <recording> <mountpoint>
+
+#define LATE_THRESHOLD (1000 * 1000)
+
+struct call {
+	uint8_t iOp;
+	bool bSkipped;
+	int iResult;
+	uint64_t iStart;
+	uint64_t iRecordedDuration;
+	uint64_t iDuration;
+	uint64_t iLateness;
+	uint64_t iOffset;
+	uint64_t iSize;
+	char* sPath;
+};
+
+struct open_file {
+	struct open_file* pNext;
+	char* sPath;
+	int iFD;
+};
+
+static struct call* g_aCalls = NULL;
+static uint64_t g_iCallCount = 0;
+static uint64_t g_iNextCall = 0;
+static const char* g_sMountpoint = NULL;
+static double g_fSpeed = 1.0;
+static bool g_bWrites = false;
+static uint64_t g_iOrigin = 0;
+
+// Reads go through descriptors that stay open for the whole replay, like the
+// ones the recorded process held between open and release.
+static pthread_mutex_t g_tFileLock = PTHREAD_MUTEX_INITIALIZER;
+static struct open_file* g_pFiles = NULL;
+
+static uint64_t _Now() {
+	struct timespec tNow;
+	clock_gettime(CLOCK_MONOTONIC, &tNow);
+	return (uint64_t)tNow.tv_sec * 1000000000 + tNow.tv_nsec;
+}
+
+static void _SleepUntil(uint64_t iTime) {
+	struct timespec tTime = { iTime / 1000000000, iTime % 1000000000 };
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tTime, NULL) == EINTR);
+}
+
+static int _FileFor(const char* sPath) {
+	pthread_mutex_lock(&g_tFileLock);
+	struct open_file* pFile = g_pFiles;
+	while(pFile && strcmp(pFile->sPath, sPath)) pFile = pFile->pNext;
+	int iFD = pFile ? pFile->iFD : -1;
+	pthread_mutex_unlock(&g_tFileLock);
+	if(pFile) return iFD;
+
+	iFD = open(sPath, O_RDONLY | O_CLOEXEC);
+	if(iFD < 0) return -errno;
+
+	pFile = malloc(sizeof(struct open_file));
+	if(!pFile || !(pFile->sPath = strdup(sPath))) {
+		free(pFile);
+		return iFD;
+	}
+
+	pthread_mutex_lock(&g_tFileLock);
+	pFile->iFD = iFD;
+	pFile->pNext = g_pFiles;
+	g_pFiles = pFile;
+	pthread_mutex_unlock(&g_tFileLock);
+	return iFD;
+}
+
+// ===================================================
+// Replay
+// ===================================================
+
+static bool _IsWrite(uint8_t iOp) {
+	return iOp == FSRECORD_CREATE || iOp == FSRECORD_WRITE || iOp == FSRECORD_TRUNCATE || iOp == FSRECORD_UNLINK || iOp == FSRECORD_MKDIR || iOp == FSRECORD_RMDIR;
+}
+
+static int _Perform(const struct call* pCall, const char* sPath, uint64_t* pStart) {
+	struct stat tStat;
+	struct statvfs tStatvfs;
+	int iFD;
+	*pStart = _Now();
+
+	switch(pCall->iOp) {
+		case FSRECORD_GETATTR: return lstat(sPath, &tStat) ? -errno : 0;
+		case FSRECORD_STATFS: return statvfs(sPath, &tStatvfs) ? -errno : 0;
+		case FSRECORD_UNLINK: return unlink(sPath) ? -errno : 0;
+		case FSRECORD_RMDIR: return rmdir(sPath) ? -errno : 0;
+		case FSRECORD_MKDIR: return mkdir(sPath, pCall->iSize & 07777) ? -errno : 0;
+		case FSRECORD_TRUNCATE: return truncate(sPath, pCall->iSize) ? -errno : 0;
+
+		case FSRECORD_READDIR: {
+			DIR* pDirectory = opendir(sPath);
+			if(!pDirectory) return -errno;
+			int iCount = 0;
+			while(readdir(pDirectory)) ++iCount;
+			closedir(pDirectory);
+			return iCount;
+		}
+
+		case FSRECORD_OPEN:
+		case FSRECORD_CREATE: {
+			int xFlags = pCall->iOp == FSRECORD_CREATE ? O_WRONLY | O_CREAT : (int)pCall->iSize & O_ACCMODE;
+			if(!g_bWrites) xFlags = O_RDONLY;
+			iFD = open(sPath, xFlags | O_CLOEXEC, pCall->iOp == FSRECORD_CREATE ? pCall->iSize & 07777 : 0);
+			if(iFD < 0) return -errno;
+			close(iFD);
+			return 0;
+		}
+
+		case FSRECORD_READ: {
+			iFD = _FileFor(sPath);
+			if(iFD < 0) return iFD;
+
+			char* pBuffer = malloc(pCall->iSize ? pCall->iSize : 1);
+			if(!pBuffer) return -ENOMEM;
+			*pStart = _Now();
+			ssize_t iRead = pread(iFD, pBuffer, pCall->iSize, pCall->iOffset);
+			free(pBuffer);
+			return iRead < 0 ? -errno : iRead;
+		}
+
+		case FSRECORD_WRITE: {
+			iFD = open(sPath, O_WRONLY | O_CLOEXEC);
+			if(iFD < 0) return -errno;
+
+			char* pBuffer = calloc(1, pCall->iSize ? pCall->iSize : 1);
+			ssize_t iWritten = pBuffer ? pwrite(iFD, pBuffer, pCall->iSize, pCall->iOffset) : -1;
+			int iError = errno;
+			free(pBuffer);
+			close(iFD);
+			return iWritten < 0 ? -iError : iWritten;
+		}
+
+		default: return -ENOSYS;
+	}
+}
+
+static void* _Worker(void* pArgument) {
+	char sPath[PATH_MAX * 2];
+	for(;;) {
+		uint64_t iIndex = __atomic_fetch_add(&g_iNextCall, 1, __ATOMIC_RELAXED);
+		if(iIndex >= g_iCallCount) return NULL;
+
+		struct call* pCall = &g_aCalls[iIndex];
+		if(pCall->iOp == FSRECORD_RELEASE || (_IsWrite(pCall->iOp) && !g_bWrites)) {
+			pCall->bSkipped = true;
+			continue;
+		}
+
+		uint64_t iDue = g_iOrigin;
+		if(g_fSpeed > 0) {
+			iDue += pCall->iStart / g_fSpeed;
+			_SleepUntil(iDue);
+		}
+
+		snprintf(sPath, sizeof(sPath), "%s%s", g_sMountpoint, pCall->sPath);
+		uint64_t iStart;
+		pCall->iResult = _Perform(pCall, sPath, &iStart);
+		pCall->iDuration = _Now() - iStart;
+		pCall->iLateness = g_fSpeed > 0 && iStart > iDue ? iStart - iDue : 0;
+	}
+}
+
+// ===================================================
+// Report
+// ===================================================
+
+static int _Compare(const void* pA, const void* pB) {
+	uint64_t iA = *(const uint64_t*)pA;
+	uint64_t iB = *(const uint64_t*)pB;
+	return iA < iB ? -1 : iA > iB;
+}
+
+static double _Percentile(const uint64_t* aValues, uint64_t iCount, double fPercentile) {
+	if(!iCount) return 0;
+	uint64_t iIndex = ceil(fPercentile / 100 * iCount);
+	return aValues[iIndex ? iIndex - 1 : 0] / 1000.0;
+}
+
+static void _Report(uint64_t iElapsed) {
+	uint64_t* aRecorded = malloc(g_iCallCount * sizeof(uint64_t));
+	uint64_t* aReplayed = malloc(g_iCallCount * sizeof(uint64_t));
+	if(!aRecorded || !aReplayed) exit(1);
+
+	printf("%-9s %8s %7s %7s | %10s %10s %10s | %10s %10s %10s %10s %10s\n",
+		"op", "calls", "errors", "skipped", "rec p50", "rec p99", "rec mean", "p50", "p90", "p99", "max", "mean");
+
+	uint64_t iLate = 0;
+	for(uint8_t iOp = 0; iOp < FSRECORD_OP_COUNT; ++iOp) {
+		uint64_t iCount = 0, iReplayed = 0, iErrors = 0, iSkipped = 0;
+		double fRecordedTotal = 0, fReplayedTotal = 0;
+		for(uint64_t i = 0; i < g_iCallCount; ++i) {
+			const struct call* pCall = &g_aCalls[i];
+			if(pCall->iOp != iOp) continue;
+
+			aRecorded[iCount++] = pCall->iRecordedDuration;
+			fRecordedTotal += pCall->iRecordedDuration;
+			if(pCall->bSkipped) {
+				++iSkipped;
+				continue;
+			}
+
+			aReplayed[iReplayed++] = pCall->iDuration;
+			fReplayedTotal += pCall->iDuration;
+			if(pCall->iResult < 0) ++iErrors;
+			if(pCall->iLateness > LATE_THRESHOLD) ++iLate;
+		}
+
+		if(!iCount) continue;
+		qsort(aRecorded, iCount, sizeof(uint64_t), _Compare);
+		qsort(aReplayed, iReplayed, sizeof(uint64_t), _Compare);
+
+		printf("%-9s %8lu %7lu %7lu | %10.1f %10.1f %10.1f", fsrecord_op_name(iOp), iCount, iErrors, iSkipped,
+			_Percentile(aRecorded, iCount, 50), _Percentile(aRecorded, iCount, 99), fRecordedTotal / iCount / 1000);
+		if(iReplayed) {
+			printf(" | %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+				_Percentile(aReplayed, iReplayed, 50), _Percentile(aReplayed, iReplayed, 90), _Percentile(aReplayed, iReplayed, 99),
+				aReplayed[iReplayed - 1] / 1000.0, fReplayedTotal / iReplayed / 1000);
+		} else {
+			printf(" | %10s %10s %10s %10s %10s\n", "-", "-", "-", "-", "-");
+		}
+	}
+
+	uint64_t iRecordedSpan = g_iCallCount ? g_aCalls[g_iCallCount - 1].iStart : 0;
+	printf("\nLatencies in us. Replayed %lu calls in %.3f s (recorded over %.3f s)", g_iCallCount, iElapsed / 1e9, iRecordedSpan / 1e9);
+	if(g_fSpeed > 0) printf(", %lu started more than %u ms late", iLate, LATE_THRESHOLD / 1000000);
+	printf(".\n");
+
+	free(aRecorded);
+	free(aReplayed);
+}
+
+// ===================================================
+
+static int _CompareStart(const void* pA, const void* pB) {
+	const struct call* pCallA = pA;
+	const struct call* pCallB = pB;
+	return pCallA->iStart < pCallB->iStart ? -1 : pCallA->iStart > pCallB->iStart;
+}
+
+static int _Load(const char* sPath) {
+	int iFD = open(sPath, O_RDONLY | O_CLOEXEC);
+	struct stat tStat;
+	if(iFD < 0 || fstat(iFD, &tStat)) {
+		perror(sPath);
+		return -1;
+	}
+
+	void* pData = tStat.st_size ? mmap(NULL, tStat.st_size, PROT_READ, MAP_PRIVATE, iFD, 0) : MAP_FAILED;
+	close(iFD);
+	if(pData == MAP_FAILED) {
+		fprintf(stderr, "%s: empty or unreadable recording\n", sPath);
+		return -1;
+	}
+
+	struct fsrecord_reader tReader;
+	struct fsrecord_entry tEntry;
+	uint64_t iCapacity = 0;
+	int iStatus = fsrecord_reader_begin(&tReader, pData, tStat.st_size);
+	while(!iStatus && (iStatus = fsrecord_reader_next(&tReader, &tEntry)) > 0) {
+		if(g_iCallCount == iCapacity) {
+			iCapacity = iCapacity ? iCapacity * 2 : 4096;
+			struct call* aResized = realloc(g_aCalls, iCapacity * sizeof(struct call));
+			if(!aResized) return -1;
+			g_aCalls = aResized;
+		}
+
+		g_aCalls[g_iCallCount++] = (struct call){
+			.iOp = tEntry.iOp,
+			.iStart = tEntry.iStart,
+			.iRecordedDuration = tEntry.iDuration,
+			.iOffset = tEntry.iOffset,
+			.iSize = tEntry.iSize,
+			.sPath = strdup(tEntry.sPath),
+		};
+
+		if(!g_aCalls[g_iCallCount - 1].sPath) return -1;
+		iStatus = 0;
+	}
+
+	munmap(pData, tStat.st_size);
+	if(iStatus < 0) {
+		// A recording cut off by a crash still replays up to the damage.
+		fprintf(stderr, "%s: invalid record after %lu calls\n", sPath, g_iCallCount);
+		if(!g_iCallCount) return -1;
+	}
+
+	// Records are written as calls complete, replay issues them as they started.
+	qsort(g_aCalls, g_iCallCount, sizeof(struct call), _CompareStart);
+	return 0;
+}
+
+static int _Usage(const char* sProgram) {
+	fprintf(stderr, "Usage: %s [-s speed, 0 for as fast as possible] [-j jobs] [-w] <recording> <mountpoint>\n", sProgram);
+	return 1;
+}
+
+int main(int argc, char* argv[]) {
+	uint32_t iJobs = 16;
+	int iOption;
+	while((iOption = getopt(argc, argv, "s:j:w")) != -1) {
+		switch(iOption) {
+			case 's': g_fSpeed = atof(optarg); break;
+			case 'j': iJobs = strtoul(optarg, NULL, 10); break;
+			case 'w': g_bWrites = true; break;
+			default: return _Usage(argv[0]);
+		}
+	}
+
+	if(optind + 2 != argc || !iJobs || g_fSpeed < 0) return _Usage(argv[0]);
+	g_sMountpoint = argv[optind + 1];
+	if(_Load(argv[optind])) return 1;
+
+	pthread_t aThreads[iJobs];
+	g_iOrigin = _Now();
+	uint32_t iStarted = 0;
+	while(iStarted < iJobs && pthread_create(&aThreads[iStarted], NULL, _Worker, NULL) == 0) ++iStarted;
+	if(!iStarted) _Worker(NULL);
+	while(iStarted) pthread_join(aThreads[--iStarted], NULL);
+
+	_Report(_Now() - g_iOrigin);
+	return 0;
+}
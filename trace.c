@@ -0,0 +1,322 @@
+#include "trace.h"
+#include "os.h"
+#include <semaphore.h>
+#include <sys/syscall.h>
+
+#define RING_SIZE 4096
+#define MAX_DETAIL_SIZE 96
+
+// Every thread records into a ring of its own, so recording never takes a
+// lock. Each slot is guarded by a sequence number that is odd while the slot
+// is being written, which lets the dumper skip slots it raced with instead of
+// emitting torn spans. Rings of exited threads are handed to new threads
+// together with their spans, which keeps memory bounded under libfuse's
+// dynamic thread pool.
+struct trace_span {
+	uint32_t iSequence;
+	uint32_t iThreadId;
+	uint64_t iStart;
+	uint64_t iEnd;
+	uint64_t iOffset;
+	uint64_t iSize;
+	const char* sName;
+	char sDetail[MAX_DETAIL_SIZE];
+};
+
+struct trace_ring {
+	struct trace_ring* pNext;
+	bool bFree;
+	uint64_t iHead;
+	struct trace_span aSpans[RING_SIZE];
+};
+
+bool g_bTraceEnabled = false;
+
+static struct trace_ring* g_pRings = NULL;
+static __thread struct trace_ring* t_pRing = NULL;
+static __thread uint32_t t_iThreadId = 0;
+static pthread_key_t g_hRingKey;
+static pthread_once_t g_tRingKeyOnce = PTHREAD_ONCE_INIT;
+static uint64_t g_iEpoch = 0;
+
+static pthread_mutex_t g_tDumpLock = PTHREAD_MUTEX_INITIALIZER;
+static char* g_sPath = NULL;
+static char* g_sDirectory = NULL;
+static sem_t g_tDumpRequest;
+static pthread_t g_hDumper;
+static bool g_bDumper = false;
+static bool g_bStopping = false;
+
+static void _ReleaseRing(void* pRing) {
+	__atomic_store_n(&((struct trace_ring*)pRing)->bFree, true, __ATOMIC_RELEASE);
+}
+
+static void _CreateRingKey() {
+	pthread_key_create(&g_hRingKey, _ReleaseRing);
+}
+
+static struct trace_ring* _ClaimRing() {
+	pthread_once(&g_tRingKeyOnce, _CreateRingKey);
+
+	struct trace_ring* pRing = __atomic_load_n(&g_pRings, __ATOMIC_ACQUIRE);
+	for(; pRing; pRing = pRing->pNext) {
+		bool bFree = true;
+		if(__atomic_compare_exchange_n(&pRing->bFree, &bFree, false, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+	}
+
+	if(!pRing) {
+		if(!(pRing = calloc(1, sizeof(struct trace_ring)))) return NULL;
+		pRing->pNext = __atomic_load_n(&g_pRings, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&g_pRings, &pRing->pNext, pRing, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	pthread_setspecific(g_hRingKey, pRing);
+	t_iThreadId = syscall(SYS_gettid);
+	return pRing;
+}
+
+void fstrace_record(const char* sName, const char* sDetail, uint64_t iStart, uint64_t iEnd, uint64_t iOffset, uint64_t iSize) {
+	struct trace_ring* pRing = t_pRing;
+	if(!pRing && !(pRing = t_pRing = _ClaimRing())) return;
+
+	struct trace_span* pSpan = &pRing->aSpans[pRing->iHead % RING_SIZE];
+	uint32_t iSequence = pSpan->iSequence;
+	__atomic_store_n(&pSpan->iSequence, iSequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	pSpan->iThreadId = t_iThreadId;
+	pSpan->iStart = iStart;
+	pSpan->iEnd = iEnd;
+	pSpan->iOffset = iOffset;
+	pSpan->iSize = iSize;
+	pSpan->sName = sName;
+	if(sDetail) {
+		strncpy(pSpan->sDetail, sDetail, MAX_DETAIL_SIZE - 1);
+		pSpan->sDetail[MAX_DETAIL_SIZE - 1] = '\0';
+	} else pSpan->sDetail[0] = '\0';
+
+	__atomic_store_n(&pSpan->iSequence, iSequence + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&pRing->iHead, pRing->iHead + 1, __ATOMIC_RELEASE);
+}
+
+// ===================================================
+
+static void _WriteString(FILE* hFile, const char* sValue) {
+	fputc('"', hFile);
+	for(; *sValue; ++sValue) {
+		unsigned char iChar = *sValue;
+		if(iChar == '"' || iChar == '\\') fprintf(hFile, "\\%c", iChar);
+		else if(iChar < 0x20) fprintf(hFile, "\\u%04x", iChar);
+		else fputc(iChar, hFile);
+	}
+
+	fputc('"', hFile);
+}
+
+static bool _CopySpan(struct trace_span* pSpan, struct trace_span* pOutput) {
+	uint32_t iSequence = __atomic_load_n(&pSpan->iSequence, __ATOMIC_ACQUIRE);
+	if(iSequence & 1 || !iSequence) return false;
+	memcpy(pOutput, pSpan, sizeof(struct trace_span));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&pSpan->iSequence, __ATOMIC_RELAXED) == iSequence;
+}
+
+static int _Dump(const char* sPath) {
+	// The spans are written to a new file next to the target and renamed
+	// over it. mkstemp() creates it exclusively and only for the owner, so a
+	// planted file or symlink can neither be followed nor read.
+	char sTemporary[PATH_MAX];
+	if(snprintf(sTemporary, sizeof(sTemporary), "%s.XXXXXX", sPath) >= (int)sizeof(sTemporary)) return -ENAMETOOLONG;
+
+	int iFD = mkstemp(sTemporary);
+	if(iFD < 0) return -errno;
+
+	FILE* hFile = fdopen(iFD, "w");
+	if(!hFile) {
+		int iError = errno;
+		close(iFD);
+		unlink(sTemporary);
+		return -iError;
+	}
+
+	// Chrome trace event format, also understood by Perfetto.
+	fprintf(hFile, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(hFile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"hexalinq-drive\"}}", getpid());
+
+	struct trace_span tSpan;
+	for(struct trace_ring* pRing = __atomic_load_n(&g_pRings, __ATOMIC_ACQUIRE); pRing; pRing = pRing->pNext) {
+		uint64_t iHead = __atomic_load_n(&pRing->iHead, __ATOMIC_ACQUIRE);
+		uint64_t iFirst = iHead > RING_SIZE ? iHead - RING_SIZE : 0;
+		for(uint64_t i = iFirst; i < iHead; ++i) {
+			if(!_CopySpan(&pRing->aSpans[i % RING_SIZE], &tSpan) || tSpan.iStart < g_iEpoch) continue;
+
+			fprintf(hFile, ",\n{\"name\":");
+			_WriteString(hFile, tSpan.sName);
+			fprintf(hFile, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"detail\":",
+				getpid(), tSpan.iThreadId,
+				(tSpan.iStart - g_iEpoch) / 1000.0,
+				(tSpan.iEnd - tSpan.iStart) / 1000.0
+			);
+			_WriteString(hFile, tSpan.sDetail);
+			fprintf(hFile, ",\"offset\":%lu,\"size\":%lu}}", tSpan.iOffset, tSpan.iSize);
+		}
+	}
+
+	fprintf(hFile, "\n]}\n");
+	if(fclose(hFile)) {
+		unlink(sTemporary);
+		return -EIO;
+	}
+
+	if(rename(sTemporary, sPath)) {
+		int iError = errno;
+		unlink(sTemporary);
+		return -iError;
+	}
+
+	return 0;
+}
+
+int fstrace_dump(const char* sPath) {
+	if(!sPath) return -EINVAL;
+
+	pthread_mutex_lock(&g_tDumpLock);
+	int iStatus = _Dump(sPath);
+	pthread_mutex_unlock(&g_tDumpLock);
+	return iStatus;
+}
+
+static void _HandleSignal(int iSignal) {
+	sem_post(&g_tDumpRequest);
+}
+
+static void* _Dumper(void* pArgument) {
+	for(;;) {
+		while(sem_wait(&g_tDumpRequest) && errno == EINTR);
+		if(__atomic_load_n(&g_bStopping, __ATOMIC_ACQUIRE)) break;
+
+		int iStatus = fstrace_dump(g_sPath);
+		if(iStatus) fprintf(stderr, "trace: %s: %s\n", g_sPath, strerror(-iStatus));
+	}
+
+	return NULL;
+}
+
+// ===================================================
+
+// The daemon changes to / after forking, so a relative path is resolved
+// against the directory it was started from. The file itself may not exist
+// yet, only its directory is resolved.
+static char* _ResolvePath(const char* sPath) {
+	const char* pSlash = strrchr(sPath, '/');
+	const char* sName = pSlash ? pSlash + 1 : sPath;
+	char sDirectory[PATH_MAX];
+	if(!pSlash) strcpy(sDirectory, ".");
+	else if(pSlash == sPath) strcpy(sDirectory, "/");
+	else if((size_t)(pSlash - sPath) < sizeof(sDirectory)) {
+		memcpy(sDirectory, sPath, pSlash - sPath);
+		sDirectory[pSlash - sPath] = '\0';
+	} else return NULL;
+
+	char sResolved[PATH_MAX];
+	if(!*sName || !realpath(sDirectory, sResolved)) return NULL;
+
+	char* sOutput = malloc(strlen(sResolved) + strlen(sName) + 2);
+	if(sOutput) sprintf(sOutput, "%s/%s", strcmp(sResolved, "/") ? sResolved : "", sName);
+	return sOutput;
+}
+
+// Without a trace file, dumps go to a directory only the user can write to:
+// the cache directory, the user's runtime directory, /run for root, or the
+// home directory.
+static const char* _DefaultDirectory(const char* sCacheDir) {
+	if(sCacheDir) return sCacheDir;
+	const char* sRuntime = getenv("XDG_RUNTIME_DIR");
+	if(sRuntime && *sRuntime) return sRuntime;
+	if(!geteuid()) return "/run";
+	const char* sHome = getenv("HOME");
+	return sHome && *sHome ? sHome : NULL;
+}
+
+int8_t fstrace_configure(bool bEnabled, const char* sPath, const char* sCacheDir) {
+	if(sPath && !(g_sPath = _ResolvePath(sPath))) {
+		fprintf(stderr, "trace: %s: Invalid trace file\n", sPath);
+		return -1;
+	}
+
+	const char* sDirectory = _DefaultDirectory(sCacheDir);
+	if(!sPath && sDirectory && !(g_sDirectory = realpath(sDirectory, NULL))) {
+		fprintf(stderr, "trace: %s: %s\n", sDirectory, strerror(errno));
+		return -1;
+	}
+
+	g_iEpoch = fsstats_now();
+	fstrace_set_enabled(bEnabled);
+	return 0;
+}
+
+void fstrace_set_enabled(bool bEnabled) {
+	__atomic_store_n(&g_bTraceEnabled, bEnabled, __ATOMIC_RELAXED);
+}
+
+// The dumper and the SIGUSR1 handler are only set up once tracing is turned
+// on, so a mount that never traces has no extra thread and leaves the signal
+// alone.
+static int8_t _StartDumper() {
+	int8_t iStatus = 0;
+	pthread_mutex_lock(&g_tDumpLock);
+	if(!g_bDumper) {
+		struct sigaction tAction = { 0 };
+		tAction.sa_handler = _HandleSignal;
+		tAction.sa_flags = SA_RESTART;
+		sigemptyset(&tAction.sa_mask);
+		if(sem_init(&g_tDumpRequest, 0, 0)) iStatus = -1;
+		else if(pthread_create(&g_hDumper, NULL, _Dumper, NULL)) iStatus = -1;
+		else {
+			g_bDumper = true;
+			if(sigaction(SIGUSR1, &tAction, NULL)) iStatus = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&g_tDumpLock);
+	return iStatus;
+}
+
+int8_t fstrace_start() {
+	// The daemon forks after the options are parsed, so the process ID in
+	// the default file name is only known at this point.
+	if(!g_sPath && g_sDirectory) {
+		char sDefault[PATH_MAX];
+		if(snprintf(sDefault, sizeof(sDefault), "%s/hexalinq-drive-trace.%d.json", g_sDirectory, getpid()) >= (int)sizeof(sDefault)) return -1;
+		if(!(g_sPath = strdup(sDefault))) return -1;
+	}
+
+	if(!__atomic_load_n(&g_bTraceEnabled, __ATOMIC_RELAXED)) return 0;
+	return _StartDumper();
+}
+
+void fstrace_stop() {
+	if(g_bDumper) {
+		signal(SIGUSR1, SIG_IGN);
+		__atomic_store_n(&g_bStopping, true, __ATOMIC_RELEASE);
+		sem_post(&g_tDumpRequest);
+		pthread_join(g_hDumper, NULL);
+		g_bDumper = false;
+	}
+
+	free(g_sPath);
+	g_sPath = NULL;
+	free(g_sDirectory);
+	g_sDirectory = NULL;
+}
+
+int fstrace_command(const char* sCommand) {
+	if(strcmp(sCommand, "on") == 0 || strcmp(sCommand, "1") == 0) {
+		if(_StartDumper()) return -EIO;
+		fstrace_set_enabled(true);
+	}
+	else if(strcmp(sCommand, "off") == 0 || strcmp(sCommand, "0") == 0) fstrace_set_enabled(false);
+	else if(strcmp(sCommand, "dump") == 0) return fstrace_dump(g_sPath);
+	else return -EINVAL;
+	return 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "stats.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Spans are only timestamped while tracing is enabled, so a disabled span
+// costs one predictable branch when it starts and another when it ends.
+struct fstrace_scope {
+	uint64_t iStart;
+	const char* sName;
+	const char* sDetail;
+	uint64_t iOffset;
+	uint64_t iSize;
+};
+
+extern bool g_bTraceEnabled;
+
+void fstrace_record(const char* sName, const char* sDetail, uint64_t iStart, uint64_t iEnd, uint64_t iOffset, uint64_t iSize);
+
+static inline uint64_t fstrace_begin() {
+	if(__builtin_expect(!__atomic_load_n(&g_bTraceEnabled, __ATOMIC_RELAXED), 1)) return 0;
+	return fsstats_now();
+}
+
+static inline void fstrace_end(const char* sName, const char* sDetail, uint64_t iStart, uint64_t iOffset, uint64_t iSize) {
+	if(__builtin_expect(!iStart, 1)) return;
+	fstrace_record(sName, sDetail, iStart, fsstats_now(), iOffset, iSize);
+}
+
+static inline void _fstrace_scope_end(struct fstrace_scope* pScope) {
+	fstrace_end(pScope->sName, pScope->sDetail, pScope->iStart, pScope->iOffset, pScope->iSize);
+}
+
+#define _FSTRACE_CONCAT(sA, sB) sA##sB
+#define _FSTRACE_NAME(iCounter) _FSTRACE_CONCAT(tTraceScope, iCounter)
+
+// Every scope gets a variable of its own, so a function can open a nested
+// phase such as "parse" next to the span of the call itself.
+#define FSTRACE_SCOPE(sName, sDetail, iOffset, iSize) \
+	struct fstrace_scope __attribute__((cleanup(_fstrace_scope_end))) _FSTRACE_NAME(__COUNTER__) = { fstrace_begin(), (sName), (sDetail), (iOffset), (iSize) }
+
+int8_t fstrace_configure(bool bEnabled, const char* sPath, const char* sCacheDir);
+void fstrace_set_enabled(bool bEnabled);
+int8_t fstrace_start();
+void fstrace_stop();
+int fstrace_dump(const char* sPath);
+int fstrace_command(const char* sCommand);
@@ -0,0 +1,193 @@
+#include "warmup.h"
+#include "driver.h"
+#include "wire.h"
+#include "stats.h"
+#include "trace.h"
+#include "sched.h"
+#include "cache.h"
+#include "os.h"
+
+// The crawler is a pool of workers sharing one queue of directories. Each
+// READDIR fills the attribute cache for every entry it returns, subdirectories
+// are queued for the next free worker, and files up to the prefetch limit are
+// read in full into the data cache. The crawl ends once the queue is empty and
+// no worker is still listing a directory that could add to it.
+struct crawl_item {
+	struct crawl_item* pNext;
+	char sPath[];
+};
+
+static pthread_mutex_t g_tLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_tCondition = PTHREAD_COND_INITIALIZER;
+static struct crawl_item* g_pQueueHead = NULL;
+static struct crawl_item* g_pQueueTail = NULL;
+static uint32_t g_iActive = 0;
+static uint32_t g_iWorkers = 0;
+static bool g_bCancel = false;
+
+static uint32_t g_iJobs = 8;
+static uint64_t g_iPrefetchLimit = 0;
+static char* g_sStartPath = NULL;
+
+static int8_t _Enqueue(const char* sPath) {
+	size_t iPathSize = strlen(sPath) + 1;
+	struct crawl_item* pItem = malloc(sizeof(struct crawl_item) + iPathSize);
+	if(!pItem) return -1;
+
+	memcpy(pItem->sPath, sPath, iPathSize);
+	pItem->pNext = NULL;
+
+	pthread_mutex_lock(&g_tLock);
+	if(g_pQueueTail) g_pQueueTail->pNext = pItem;
+	else g_pQueueHead = pItem;
+	g_pQueueTail = pItem;
+	pthread_cond_signal(&g_tCondition);
+	pthread_mutex_unlock(&g_tLock);
+
+	FSSTATS_ADD(iWarmupDirsQueued, 1);
+	return 0;
+}
+
+static int _Visit(void* pContext, const char* sName, const char* sPath, const struct stat* pStat) {
+	if(__atomic_load_n(&g_bCancel, __ATOMIC_RELAXED)) return -ECANCELED;
+	if(!pStat) return -EPROTO;
+
+	if(S_ISDIR(pStat->st_mode)) {
+		if(_Enqueue(sPath)) FSSTATS_ADD(iWarmupErrors, 1);
+		return 0;
+	}
+
+	FSSTATS_ADD(iWarmupFiles, 1);
+	if(!g_iPrefetchLimit || (uint64_t)pStat->st_size > g_iPrefetchLimit) return 0;
+
+	if(fsdriver_prefetch(sPath, pStat)) {
+		FSSTATS_ADD(iWarmupErrors, 1);
+		return 0;
+	}
+
+	FSSTATS_ADD(iWarmupFilesPrefetched, 1);
+	FSSTATS_ADD(iWarmupBytesPrefetched, pStat->st_size);
+	return 0;
+}
+
+static void* _Worker(void* pArgument) {
+	fssched_set_thread_lane(FSSCHED_BACKGROUND);
+	pthread_mutex_lock(&g_tLock);
+	for(;;) {
+		while(!g_pQueueHead && g_iActive && !g_bCancel) pthread_cond_wait(&g_tCondition, &g_tLock);
+		if(g_bCancel || !g_pQueueHead) break;
+
+		struct crawl_item* pItem = g_pQueueHead;
+		g_pQueueHead = pItem->pNext;
+		if(!g_pQueueHead) g_pQueueTail = NULL;
+		++g_iActive;
+		pthread_mutex_unlock(&g_tLock);
+
+		uint64_t iTrace = fstrace_begin();
+		int iStatus = fsdriver_list(pItem->sPath, FSWIRE_TYPE | FSWIRE_SIZE | FSWIRE_MTIME, _Visit, NULL);
+		if(iStatus && iStatus != -ECANCELED) {
+			fprintf(stderr, "warmup: %s: %s\n", pItem->sPath, strerror(-iStatus));
+			FSSTATS_ADD(iWarmupErrors, 1);
+		}
+
+		fstrace_end("warmup", pItem->sPath, iTrace, 0, 0);
+		FSSTATS_ADD(iWarmupDirsDone, 1);
+		free(pItem);
+
+		pthread_mutex_lock(&g_tLock);
+		if(!--g_iActive) pthread_cond_broadcast(&g_tCondition);
+	}
+
+	if(!--g_iWorkers) {
+		while(g_pQueueHead) {
+			struct crawl_item* pItem = g_pQueueHead;
+			g_pQueueHead = pItem->pNext;
+			free(pItem);
+		}
+
+		g_pQueueTail = NULL;
+		FSSTATS_SET(iWarmupEndTime, fsstats_now());
+		FSSTATS_SET(bWarmupRunning, 0);
+	}
+
+	pthread_cond_broadcast(&g_tCondition);
+	pthread_mutex_unlock(&g_tLock);
+	return NULL;
+}
+
+// ===================================================
+
+int8_t fswarmup_configure(uint32_t iJobs, uint64_t iPrefetchLimit, const char* sStartPath) {
+	g_iJobs = iJobs ? iJobs : 1;
+	g_iPrefetchLimit = iPrefetchLimit;
+	if(sStartPath && !(g_sStartPath = strdup(sStartPath))) return -1;
+	return 0;
+}
+
+void fswarmup_autostart() {
+	if(!g_sStartPath) return;
+	int iStatus = fswarmup_start(g_sStartPath);
+	if(iStatus) fprintf(stderr, "warmup: %s: %s\n", g_sStartPath, strerror(-iStatus));
+}
+
+// Without an attribute cache the crawl would not keep anything it fetched.
+int fswarmup_start(const char* sPath) {
+	if(sPath[0] != '/') return -EINVAL;
+	if(!fscache_enabled()) return -ENOTSUP;
+
+	pthread_mutex_lock(&g_tLock);
+	if(g_iWorkers) {
+		pthread_mutex_unlock(&g_tLock);
+		return -EBUSY;
+	}
+
+	g_bCancel = false;
+	g_iWorkers = g_iJobs;
+	FSSTATS_SET(bWarmupRunning, 1);
+	FSSTATS_SET(iWarmupStartTime, fsstats_now());
+	FSSTATS_ADD(iWarmupRuns, 1);
+	pthread_mutex_unlock(&g_tLock);
+
+	if(_Enqueue(sPath)) {
+		pthread_mutex_lock(&g_tLock);
+		g_iWorkers = 0;
+		FSSTATS_SET(bWarmupRunning, 0);
+		pthread_mutex_unlock(&g_tLock);
+		return -ENOMEM;
+	}
+
+	pthread_attr_t tAttributes;
+	pthread_attr_init(&tAttributes);
+	pthread_attr_setdetachstate(&tAttributes, PTHREAD_CREATE_DETACHED);
+
+	for(uint32_t i = 0; i < g_iJobs; ++i) {
+		pthread_t hThread;
+		if(pthread_create(&hThread, &tAttributes, _Worker, NULL) == 0) continue;
+
+		pthread_mutex_lock(&g_tLock);
+		g_iWorkers -= g_iJobs - i;
+		if(!g_iWorkers) {
+			g_bCancel = true;
+			free(g_pQueueHead);
+			g_pQueueHead = g_pQueueTail = NULL;
+			FSSTATS_SET(bWarmupRunning, 0);
+		}
+
+		pthread_mutex_unlock(&g_tLock);
+		break;
+	}
+
+	pthread_attr_destroy(&tAttributes);
+	return 0;
+}
+
+void fswarmup_stop() {
+	pthread_mutex_lock(&g_tLock);
+	g_bCancel = true;
+	pthread_cond_broadcast(&g_tCondition);
+	while(g_iWorkers) pthread_cond_wait(&g_tCondition, &g_tLock);
+	pthread_mutex_unlock(&g_tLock);
+
+	free(g_sStartPath);
+	g_sStartPath = NULL;
+}
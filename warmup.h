@@ -0,0 +1,8 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+int8_t fswarmup_configure(uint32_t iJobs, uint64_t iPrefetchLimit, const char* sStartPath);
+void fswarmup_autostart();
+int fswarmup_start(const char* sPath);
+void fswarmup_stop();
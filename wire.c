@@ -0,0 +1,289 @@
+#include "wire.h"
+#include <string.h>
+#include <errno.h>
+
+// ===================================================
+// Decoding
+// ===================================================
+
+static inline bool _ReadVarint(const uint8_t** ppCursor, const uint8_t* pEnd, uint64_t* pValue) {
+	const uint8_t* pCursor = *ppCursor;
+	if(__builtin_expect(pCursor < pEnd && !(*pCursor & 0x80), 1)) {
+		*pValue = *pCursor;
+		*ppCursor = pCursor + 1;
+		return true;
+	}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	// Varints of up to 8 bytes (56 bits) are decoded from a single load
+	// without a data dependent branch per byte.
+	if(__builtin_expect(pEnd - pCursor >= 8, 1)) {
+		uint64_t iWord;
+		memcpy(&iWord, pCursor, 8);
+		uint64_t xStops = ~iWord & 0x8080808080808080;
+		if(xStops) {
+			uint8_t iBits = __builtin_ctzll(xStops) + 1;
+			uint64_t iValue = iBits == 64 ? iWord : iWord & ((1ULL << iBits) - 1);
+			iValue = ((iValue & 0x7f007f007f007f00) >> 1) | (iValue & 0x007f007f007f007f);
+			iValue = ((iValue & 0x3fff00003fff0000) >> 2) | (iValue & 0x00003fff00003fff);
+			iValue = ((iValue & 0x0fffffff00000000) >> 4) | (iValue & 0x000000000fffffff);
+			*pValue = iValue;
+			*ppCursor = pCursor + iBits / 8;
+			return true;
+		}
+	}
+#endif
+
+	uint64_t iValue = 0;
+	for(uint8_t iShift = 0; iShift < 64 && pCursor < pEnd; iShift += 7) {
+		uint8_t iByte = *pCursor++;
+		iValue |= (uint64_t)(iByte & 0x7f) << iShift;
+		if(!(iByte & 0x80)) {
+			*pValue = iValue;
+			*ppCursor = pCursor;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static inline bool _ReadTime(const uint8_t** ppCursor, const uint8_t* pEnd, uint64_t* pPreviousSeconds, struct fsrpc_timespec* pTime) {
+	uint64_t iDelta, iNanoseconds;
+	if(!_ReadVarint(ppCursor, pEnd, &iDelta) || !_ReadVarint(ppCursor, pEnd, &iNanoseconds)) return false;
+	*pPreviousSeconds += (iDelta >> 1) ^ -(iDelta & 1);
+	pTime->iSeconds = *pPreviousSeconds;
+	pTime->iNanoseconds = iNanoseconds;
+	return true;
+}
+
+static int _NextLE1(struct fswire_decoder* pDecoder, struct fswire_entry* pEntry) {
+	size_t iRemaining = pDecoder->pEnd - pDecoder->pCursor;
+	if(iRemaining < sizeof(struct fsrpc_dirent)) return -EPROTO;
+
+	const struct fsrpc_dirent* pDirent = (const void*)pDecoder->pCursor;
+	size_t iEntrySize = sizeof(struct fsrpc_dirent) + pDirent->iNameSize + 1;
+	iEntrySize = (iEntrySize + 7) & ~(size_t)7;
+
+	if(iRemaining < iEntrySize) return -EPROTO;
+	if(pDirent->sName[pDirent->iNameSize] != '\0') return -EPROTO;
+	if(!pDirent->iNameSize || memchr(pDirent->sName, '\0', pDirent->iNameSize) || memchr(pDirent->sName, '/', pDirent->iNameSize)) return -EIO;
+
+	memcpy(&pEntry->tStat, pDirent, sizeof(struct fsrpc_stat));
+	pEntry->iNameSize = pDirent->iNameSize;
+	pEntry->sName = pDirent->sName;
+
+	pDecoder->pCursor += iEntrySize;
+	--pDecoder->iRemaining;
+	return 1;
+}
+
+static int _NextLE2(struct fswire_decoder* pDecoder, struct fswire_entry* pEntry) {
+	// Work on a local cursor so it can stay in a register; the name and stat
+	// stores below would otherwise force it to be reloaded from the decoder.
+	const uint8_t* pCursor = pDecoder->pCursor;
+	const uint8_t* pEnd = pDecoder->pEnd;
+	uint64_t iPrefix, iSuffix, iValue;
+
+	if(!_ReadVarint(&pCursor, pEnd, &iPrefix) || !_ReadVarint(&pCursor, pEnd, &iSuffix)) return -EPROTO;
+	if(iPrefix > pDecoder->iNameSize || iPrefix + iSuffix > FSWIRE_MAX_NAME) return -EPROTO;
+	if(iSuffix > (size_t)(pEnd - pCursor)) return -EPROTO;
+
+	// Suffixes are usually a few bytes long, copying and checking them in one
+	// pass is cheaper than a memchr() and memcpy() call each. A name the
+	// kernel would reject or that would escape the directory fails the
+	// listing instead of being passed on.
+	char* pName = pDecoder->sName + iPrefix;
+	uint8_t iInvalid = !(iPrefix + iSuffix);
+	for(uint64_t i = 0; i < iSuffix; ++i) {
+		char iChar = pName[i] = pCursor[i];
+		iInvalid |= (iChar == '\0') | (iChar == '/');
+	}
+
+	if(iInvalid) return -EIO;
+
+	pName[iSuffix] = '\0';
+	pDecoder->iNameSize = iPrefix + iSuffix;
+	pCursor += iSuffix;
+
+	struct fsrpc_stat tStat = { 0 };
+	uint32_t xFields = pDecoder->xFields;
+
+	if(xFields & FSWIRE_TYPE) {
+		if(pCursor >= pEnd) return -EPROTO;
+		tStat.iType = *pCursor++;
+	}
+
+	if(xFields & FSWIRE_SIZE) {
+		if(!_ReadVarint(&pCursor, pEnd, &iValue)) return -EPROTO;
+		tStat.iSize = iValue;
+	}
+
+	if(xFields & (FSWIRE_ATIME | FSWIRE_MTIME | FSWIRE_CTIME | FSWIRE_BTIME)) {
+		uint64_t* aPrevious = pDecoder->aPreviousSeconds;
+		struct fsrpc_timespec tTime;
+		if(xFields & FSWIRE_ATIME) {
+			if(!_ReadTime(&pCursor, pEnd, &aPrevious[0], &tTime)) return -EPROTO;
+			tStat.tAccessTime = tTime;
+		}
+
+		if(xFields & FSWIRE_MTIME) {
+			if(!_ReadTime(&pCursor, pEnd, &aPrevious[1], &tTime)) return -EPROTO;
+			tStat.tModificationTime = tTime;
+		}
+
+		if(xFields & FSWIRE_CTIME) {
+			if(!_ReadTime(&pCursor, pEnd, &aPrevious[2], &tTime)) return -EPROTO;
+			tStat.tMetadataChangeTime = tTime;
+		}
+
+		if(xFields & FSWIRE_BTIME) {
+			if(!_ReadTime(&pCursor, pEnd, &aPrevious[3], &tTime)) return -EPROTO;
+			tStat.tCreateTime = tTime;
+		}
+	}
+
+	if(xFields & FSWIRE_OWNER) {
+		if(!_ReadVarint(&pCursor, pEnd, &iValue) || iValue > UINT32_MAX) return -EPROTO;
+		tStat.iMappedUser = iValue;
+		if(!_ReadVarint(&pCursor, pEnd, &iValue) || iValue > UINT32_MAX) return -EPROTO;
+		tStat.iMappedGroup = iValue;
+	}
+
+	if(xFields & FSWIRE_MODE) {
+		if(!_ReadVarint(&pCursor, pEnd, &iValue) || iValue > UINT16_MAX) return -EPROTO;
+		tStat.xPermissionBits = iValue;
+	}
+
+	pEntry->tStat = tStat;
+	pEntry->iNameSize = pDecoder->iNameSize;
+	pEntry->sName = pDecoder->sName;
+	pDecoder->pCursor = pCursor;
+	--pDecoder->iRemaining;
+	return 1;
+}
+
+int fswire_readdir_begin(struct fswire_decoder* pDecoder, uint8_t iVersion, const void* pData, size_t iSize) {
+	memset(pDecoder, 0, sizeof(struct fswire_decoder));
+	pDecoder->pCursor = pData;
+	pDecoder->pEnd = pDecoder->pCursor + iSize;
+	pDecoder->iVersion = iVersion;
+
+	if(iVersion == 1) {
+		if(iSize < 8) return -EPROTO;
+		memcpy(&pDecoder->iRemaining, pData, 8);
+		pDecoder->pCursor += 8;
+		pDecoder->xFields = FSWIRE_ALL;
+		return 0;
+	}
+
+	if(iVersion != 2) return -EINVAL;
+
+	uint64_t iValue;
+	if(!_ReadVarint(&pDecoder->pCursor, pDecoder->pEnd, &iValue) || iValue > UINT8_MAX) return -EPROTO;
+	pDecoder->iError = iValue;
+	if(pDecoder->iError) return 0;
+
+	if(!_ReadVarint(&pDecoder->pCursor, pDecoder->pEnd, &iValue) || iValue & ~(uint64_t)FSWIRE_ALL) return -EPROTO;
+	pDecoder->xFields = iValue;
+	if(!_ReadVarint(&pDecoder->pCursor, pDecoder->pEnd, &pDecoder->iRemaining)) return -EPROTO;
+	return 0;
+}
+
+int fswire_readdir_next(struct fswire_decoder* pDecoder, struct fswire_entry* pEntry) {
+	if(!pDecoder->iRemaining || pDecoder->iError) return 0;
+	return pDecoder->iVersion == 1 ? _NextLE1(pDecoder, pEntry) : _NextLE2(pDecoder, pEntry);
+}
+
+// ===================================================
+// Encoding
+// ===================================================
+
+struct encoder {
+	uint8_t* pCursor;
+	uint8_t* pEnd;
+};
+
+static inline bool _WriteBytes(struct encoder* pEncoder, const void* pData, size_t iSize) {
+	if(iSize > (size_t)(pEncoder->pEnd - pEncoder->pCursor)) return false;
+	memcpy(pEncoder->pCursor, pData, iSize);
+	pEncoder->pCursor += iSize;
+	return true;
+}
+
+static inline bool _WriteVarint(struct encoder* pEncoder, uint64_t iValue) {
+	uint8_t aBytes[10];
+	size_t iSize = 0;
+	do {
+		aBytes[iSize] = iValue & 0x7f;
+		iValue >>= 7;
+		if(iValue) aBytes[iSize] |= 0x80;
+		++iSize;
+	} while(iValue);
+
+	return _WriteBytes(pEncoder, aBytes, iSize);
+}
+
+static inline bool _WriteTime(struct encoder* pEncoder, struct fsrpc_timespec tTime, uint64_t* pPreviousSeconds) {
+	int64_t iDelta = (int64_t)(tTime.iSeconds - *pPreviousSeconds);
+	*pPreviousSeconds = tTime.iSeconds;
+	return _WriteVarint(pEncoder, ((uint64_t)iDelta << 1) ^ (uint64_t)(iDelta >> 63)) && _WriteVarint(pEncoder, tTime.iNanoseconds);
+}
+
+static size_t _EncodeLE1(const struct fswire_entry* aEntries, uint64_t iCount, struct encoder* pEncoder) {
+	uint8_t* pStart = pEncoder->pCursor;
+	if(!_WriteBytes(pEncoder, &iCount, 8)) return 0;
+
+	static const uint8_t aPadding[8] = { 0 };
+	for(uint64_t i = 0; i < iCount; ++i) {
+		const struct fswire_entry* pEntry = &aEntries[i];
+		size_t iEntrySize = sizeof(struct fsrpc_dirent) + pEntry->iNameSize + 1;
+		size_t iPadding = ((iEntrySize + 7) & ~(size_t)7) - iEntrySize;
+
+		if(!_WriteBytes(pEncoder, &pEntry->tStat, sizeof(struct fsrpc_stat))) return 0;
+		if(!_WriteBytes(pEncoder, &pEntry->iNameSize, 1)) return 0;
+		if(!_WriteBytes(pEncoder, pEntry->sName, pEntry->iNameSize)) return 0;
+		if(!_WriteBytes(pEncoder, aPadding, iPadding + 1)) return 0;
+	}
+
+	return pEncoder->pCursor - pStart;
+}
+
+static size_t _EncodeLE2(uint32_t xFields, const struct fswire_entry* aEntries, uint64_t iCount, struct encoder* pEncoder) {
+	uint8_t* pStart = pEncoder->pCursor;
+	if(!_WriteVarint(pEncoder, 0) || !_WriteVarint(pEncoder, xFields) || !_WriteVarint(pEncoder, iCount)) return 0;
+
+	uint64_t aPreviousSeconds[4] = { 0 };
+	const char* sPreviousName = "";
+	uint8_t iPreviousSize = 0;
+
+	for(uint64_t i = 0; i < iCount; ++i) {
+		const struct fswire_entry* pEntry = &aEntries[i];
+		const struct fsrpc_stat* pStat = &pEntry->tStat;
+
+		uint8_t iPrefix = 0;
+		while(iPrefix < iPreviousSize && iPrefix < pEntry->iNameSize && sPreviousName[iPrefix] == pEntry->sName[iPrefix]) ++iPrefix;
+		if(!_WriteVarint(pEncoder, iPrefix) || !_WriteVarint(pEncoder, pEntry->iNameSize - iPrefix)) return 0;
+		if(!_WriteBytes(pEncoder, pEntry->sName + iPrefix, pEntry->iNameSize - iPrefix)) return 0;
+		sPreviousName = pEntry->sName;
+		iPreviousSize = pEntry->iNameSize;
+
+		if((xFields & FSWIRE_TYPE) && !_WriteBytes(pEncoder, &pStat->iType, 1)) return 0;
+		if((xFields & FSWIRE_SIZE) && !_WriteVarint(pEncoder, pStat->iSize)) return 0;
+		if((xFields & FSWIRE_ATIME) && !_WriteTime(pEncoder, pStat->tAccessTime, &aPreviousSeconds[0])) return 0;
+		if((xFields & FSWIRE_MTIME) && !_WriteTime(pEncoder, pStat->tModificationTime, &aPreviousSeconds[1])) return 0;
+		if((xFields & FSWIRE_CTIME) && !_WriteTime(pEncoder, pStat->tMetadataChangeTime, &aPreviousSeconds[2])) return 0;
+		if((xFields & FSWIRE_BTIME) && !_WriteTime(pEncoder, pStat->tCreateTime, &aPreviousSeconds[3])) return 0;
+		if((xFields & FSWIRE_OWNER) && (!_WriteVarint(pEncoder, pStat->iMappedUser) || !_WriteVarint(pEncoder, pStat->iMappedGroup))) return 0;
+		if((xFields & FSWIRE_MODE) && !_WriteVarint(pEncoder, pStat->xPermissionBits)) return 0;
+	}
+
+	return pEncoder->pCursor - pStart;
+}
+
+size_t fswire_encode_readdir(uint8_t iVersion, uint32_t xFields, const struct fswire_entry* aEntries, uint64_t iCount, void* pOutput, size_t iCapacity) {
+	struct encoder tEncoder = { pOutput, (uint8_t*)pOutput + iCapacity };
+	if(iVersion == 1) return _EncodeLE1(aEntries, iCount, &tEncoder);
+	if(iVersion == 2) return _EncodeLE2(xFields & FSWIRE_ALL, aEntries, iCount, &tEncoder);
+	return 0;
+}
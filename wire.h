@@ -0,0 +1,107 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct fsrpc_timespec {
+	uint64_t iSeconds;
+	uint64_t iNanoseconds;
+};
+
+#pragma pack(push, 1)
+typedef struct fsrpc_stat {
+	uint64_t iSize;
+	struct fsrpc_timespec tAccessTime;
+	struct fsrpc_timespec tModificationTime;
+	struct fsrpc_timespec tMetadataChangeTime;
+	struct fsrpc_timespec tCreateTime;
+	uint32_t iMappedUser;
+	uint32_t iMappedGroup;
+	uint16_t xPermissionBits;
+	uint8_t iType;
+} *fsrpc_stat_t;
+
+typedef struct fsrpc_dirent {
+	uint64_t iSize;
+	struct fsrpc_timespec tAccessTime;
+	struct fsrpc_timespec tModificationTime;
+	struct fsrpc_timespec tMetadataChangeTime;
+	struct fsrpc_timespec tCreateTime;
+	uint32_t iMappedUser;
+	uint32_t iMappedGroup;
+	uint16_t xPermissionBits;
+	uint8_t iType;
+	uint8_t iNameSize;
+	char sName[0];
+} *fsrpc_dirent_t;
+
+typedef struct fsrpc_statvfs {
+	uint64_t iTotalSpace;
+	uint64_t iFreeSpace;
+
+	uint64_t iTotalInodes;
+	uint64_t iFreeInodes;
+} *fsrpc_statvfs_t;
+#pragma pack(pop)
+//_Static_assert(sizeof(struct fsrpc_dirent) % 8 == 0);
+
+/*
+    binary-le-2 READDIR response
+
+    All integers are unsigned LEB128 varints unless noted otherwise.
+
+        varint  error code, 0 on success; nothing follows otherwise
+        varint  mask of the fields present in every entry (FSWIRE_*)
+        varint  number of entries
+        entry[]:
+            varint  length of the prefix shared with the previous name
+            varint  length of the suffix that follows
+            byte[]  suffix
+            [TYPE]  uint8_t
+            [SIZE]  varint
+            [*TIME] zigzag varint seconds, relative to the previous entry
+                    varint nanoseconds
+            [OWNER] varint user, varint group
+            [MODE]  varint permission bits
+
+    The client asks for the fields it needs with the "Fields" header and the
+    server answers with the subset it supports. Names are at most 255 bytes
+    like in binary-le-1.
+*/
+
+enum fswire_fields {
+	FSWIRE_TYPE = 1 << 0,
+	FSWIRE_SIZE = 1 << 1,
+	FSWIRE_ATIME = 1 << 2,
+	FSWIRE_MTIME = 1 << 3,
+	FSWIRE_CTIME = 1 << 4,
+	FSWIRE_BTIME = 1 << 5,
+	FSWIRE_OWNER = 1 << 6,
+	FSWIRE_MODE = 1 << 7,
+	FSWIRE_ALL = (1 << 8) - 1,
+};
+
+#define FSWIRE_MAX_NAME 255
+
+struct fswire_entry {
+	struct fsrpc_stat tStat;
+	uint8_t iNameSize;
+	const char* sName;
+};
+
+struct fswire_decoder {
+	const uint8_t* pCursor;
+	const uint8_t* pEnd;
+	uint64_t iRemaining;
+	uint32_t xFields;
+	uint8_t iVersion;
+	uint8_t iError;
+
+	uint64_t aPreviousSeconds[4];
+	uint8_t iNameSize;
+	char sName[FSWIRE_MAX_NAME + 1];
+};
+
+int fswire_readdir_begin(struct fswire_decoder* pDecoder, uint8_t iVersion, const void* pData, size_t iSize);
+int fswire_readdir_next(struct fswire_decoder* pDecoder, struct fswire_entry* pEntry);
+size_t fswire_encode_readdir(uint8_t iVersion, uint32_t xFields, const struct fswire_entry* aEntries, uint64_t iCount, void* pOutput, size_t iCapacity);